@@ -44,6 +44,7 @@
 #include <ctype.h>
 #include <assert.h>
 #include <regex.h>
+#include <fcntl.h>
 #include <sys/sysmacros.h>
 #include "nusa.h"
 #include "nusaint.h"
@@ -160,17 +161,14 @@ static int affinity_file(struct bitmask *mask, char *cls, const char *file)
 
 		if (*name == '.')
 			continue;
-		char *dev;
+		char dev[64];
 		char fn2[sizeof("/sys/class/block//dev") + strlen(name)];
 
 		n = -1;
 		if (sprintf(fn2, "/sys/class/block/%s/dev", name) < 0)
 			break;
-		dev = sysfs_read(fn2);
-		if (dev) {
+		if (sysfs_read_at(AT_FDCWD, fn2, dev, sizeof dev) > 0)
 			n = sscanf(dev, "%u:%u", &maj, &min);
-			free(dev);
-		}
 		if (n != 2) {
 			nusa_warn(W_blockdev3, "Cannot parse sysfs device %s",
 				  name);
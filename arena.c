@@ -0,0 +1,383 @@
+/* Node local arenas for small objects.
+
+   libnusa is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; version
+   2.1.
+
+   libnusa is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should find a copy of v2.1 of the GNU Lesser General Public License
+   somewhere on your Linux system; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+   An arena reserves memory in large chunks, aligned to the chunk size,
+   and applies the policy to each chunk once. Chunks are cut into slabs
+   and each slab serves one size class. A header at the start of the
+   chunk records the class of each slab, so an object can be freed
+   without its size. Each thread keeps a small free list per class and
+   only takes the arena lock to exchange a batch of objects. Nothing is
+   returned to the kernel before the arena is destroyed. */
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "nusa.h"
+#include "nusaif.h"
+#include "nusaint.h"
+#include "nusaext.h"
+
+#define ARENA_CHUNK	(2UL << 20)	/* default chunk size */
+#define ARENA_SLAB	(64UL << 10)	/* slab size */
+#define ARENA_ALIGN	16		/* minimum object alignment */
+#define CACHE_BYTES	(32UL << 10)	/* per class per thread cache */
+
+/* Size classes up to NUSA_ARENA_MAX_SIZE, roughly 1.5x apart */
+static const unsigned short class_size[] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024,
+	1536, 2048, 3072, 4096,
+};
+#define NCLASSES	(sizeof(class_size) / sizeof(class_size[0]))
+
+/* Class for each size in ARENA_ALIGN steps */
+static unsigned char size_class[NUSA_ARENA_MAX_SIZE / ARENA_ALIGN + 1];
+static pthread_once_t size_class_once = PTHREAD_ONCE_INIT;
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	struct nusa_arena *arena;
+	unsigned char slab_class[];	/* class of each slab */
+};
+
+struct arena_bin {
+	void *head;		/* free objects, linked through the first word */
+	unsigned long count;
+};
+
+struct arena_cache {
+	struct nusa_arena *arena;
+	struct arena_cache *next, **pprev;
+	struct arena_bin bin[NCLASSES];
+};
+
+struct nusa_arena {
+	pthread_mutex_t lock;
+	pthread_key_t key;
+	int policy;
+	int node;			/* node for create_onnode, else -1 */
+	struct bitmask *nodes;
+	size_t chunk_size;
+	size_t header;			/* bytes used by the chunk header */
+	struct arena_chunk *chunks;	/* all chunks, newest first */
+	unsigned next_slab;		/* next unused slab in chunks */
+	struct arena_cache *caches;	/* live thread caches */
+	struct arena_bin bin[NCLASSES];	/* objects returned by threads */
+	char *bump[NCLASSES], *bump_end[NCLASSES];
+};
+
+static void init_size_class(void)
+{
+	unsigned i, c = 0;
+
+	for (i = 0; i < sizeof(size_class); i++) {
+		while (class_size[c] < i * ARENA_ALIGN)
+			c++;
+		size_class[i] = c;
+	}
+}
+
+static unsigned long cache_limit(unsigned c)
+{
+	unsigned long n = CACHE_BYTES / class_size[c];
+
+	return n < 8 ? 8 : n > 256 ? 256 : n;
+}
+
+static struct arena_chunk *new_chunk(struct nusa_arena *a)
+{
+	size_t size = a->chunk_size;
+	char *p, *start;
+
+	/* over allocate to align the chunk to its size */
+	p = mmap(NULL, 2 * size, PROT_READ|PROT_WRITE,
+		 MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	start = (char *)(((uintptr_t)p + size - 1) & ~(size - 1));
+	if (start > p)
+		munmap(p, start - p);
+	munmap(start + size, p + size - start);
+
+	if (a->node >= 0)
+		nusa_tonode_memory(start, size, a->node);
+	else if (a->policy != MPOL_DEFAULT &&
+		 mbind(start, size, a->policy, a->nodes ? a->nodes->maskp : NULL,
+		       a->nodes ? a->nodes->size + 1 : 0, 0) < 0) {
+		munmap(start, size);
+		return NULL;
+	}
+	return (struct arena_chunk *)start;
+}
+
+/* Give class c a fresh slab to carve from. Called with the lock held. */
+static int new_slab(struct nusa_arena *a, unsigned c)
+{
+	struct arena_chunk *ch = a->chunks;
+	unsigned nslabs = a->chunk_size / ARENA_SLAB;
+	char *slab;
+
+	if (!ch || a->next_slab >= nslabs) {
+		ch = new_chunk(a);
+		if (!ch)
+			return -1;
+		ch->arena = a;
+		ch->next = a->chunks;
+		a->chunks = ch;
+		a->next_slab = 0;
+	}
+	ch->slab_class[a->next_slab] = c;
+	slab = (char *)ch + a->next_slab * ARENA_SLAB;
+	a->bump[c] = slab + (a->next_slab ? 0 : a->header);
+	a->bump_end[c] = slab + ARENA_SLAB;
+	a->next_slab++;
+	return 0;
+}
+
+/* Move up to n objects of class c from the arena into bin.
+   Called with the lock held. */
+static void refill(struct nusa_arena *a, struct arena_bin *bin, unsigned c,
+		   unsigned long n)
+{
+	struct arena_bin *shared = &a->bin[c];
+	size_t size = class_size[c];
+
+	while (n > 0 && shared->head) {
+		void *obj = shared->head;
+
+		shared->head = *(void **)obj;
+		shared->count--;
+		*(void **)obj = bin->head;
+		bin->head = obj;
+		bin->count++;
+		n--;
+	}
+	while (n > 0) {
+		void *obj;
+
+		if (a->bump_end[c] - a->bump[c] < (long)size &&
+		    new_slab(a, c) < 0)
+			return;
+		obj = a->bump[c];
+		a->bump[c] += size;
+		*(void **)obj = bin->head;
+		bin->head = obj;
+		bin->count++;
+		n--;
+	}
+}
+
+/* Return n objects from bin to the arena. Called with the lock held. */
+static void drain(struct nusa_arena *a, struct arena_bin *bin, unsigned c,
+		  unsigned long n)
+{
+	struct arena_bin *shared = &a->bin[c];
+
+	while (n-- > 0 && bin->head) {
+		void *obj = bin->head;
+
+		bin->head = *(void **)obj;
+		bin->count--;
+		*(void **)obj = shared->head;
+		shared->head = obj;
+		shared->count++;
+	}
+}
+
+static void cache_destroy(void *arg)
+{
+	struct arena_cache *cache = arg;
+	struct nusa_arena *a = cache->arena;
+	unsigned c;
+
+	pthread_mutex_lock(&a->lock);
+	for (c = 0; c < NCLASSES; c++)
+		drain(a, &cache->bin[c], c, cache->bin[c].count);
+	*cache->pprev = cache->next;
+	if (cache->next)
+		cache->next->pprev = cache->pprev;
+	pthread_mutex_unlock(&a->lock);
+	free(cache);
+}
+
+static struct arena_cache *get_cache(struct nusa_arena *a)
+{
+	struct arena_cache *cache = pthread_getspecific(a->key);
+
+	if (__builtin_expect(cache != NULL, 1))
+		return cache;
+	cache = calloc(1, sizeof(struct arena_cache));
+	if (!cache)
+		return NULL;
+	cache->arena = a;
+	pthread_mutex_lock(&a->lock);
+	cache->next = a->caches;
+	if (cache->next)
+		cache->next->pprev = &cache->next;
+	cache->pprev = &a->caches;
+	a->caches = cache;
+	pthread_mutex_unlock(&a->lock);
+	pthread_setspecific(a->key, cache);
+	return cache;
+}
+
+static struct nusa_arena *arena_create(int policy, struct bitmask *nodes,
+				       int node, size_t chunk_size)
+{
+	struct nusa_arena *a;
+	unsigned nslabs;
+
+	pthread_once(&size_class_once, init_size_class);
+	if (!chunk_size)
+		chunk_size = ARENA_CHUNK;
+	if (chunk_size < ARENA_CHUNK || (chunk_size & (chunk_size - 1)) ||
+	    chunk_size / ARENA_SLAB > ARENA_SLAB / 2 ||
+	    (policy != MPOL_DEFAULT && policy != MPOL_LOCAL && node < 0 &&
+	     (!nodes || nusa_bitmask_weight(nodes) == 0))) {
+		errno = EINVAL;
+		return NULL;
+	}
+	a = calloc(1, sizeof(struct nusa_arena));
+	if (!a)
+		return NULL;
+	if (pthread_key_create(&a->key, cache_destroy)) {
+		free(a);
+		errno = EAGAIN;
+		return NULL;
+	}
+	pthread_mutex_init(&a->lock, NULL);
+	a->policy = policy;
+	a->node = node;
+	if (nodes && node < 0 && policy != MPOL_LOCAL) {
+		a->nodes = nusa_bitmask_alloc(nodes->size);
+		copy_bitmask_to_bitmask(nodes, a->nodes);
+	}
+	a->chunk_size = chunk_size;
+	nslabs = chunk_size / ARENA_SLAB;
+	a->header = (offsetof(struct arena_chunk, slab_class) + nslabs +
+		     63) & ~63UL;
+	return a;
+}
+
+/* Create an arena whose chunks are placed with policy on nodes, which
+   MPOL_DEFAULT and MPOL_LOCAL ignore. chunk_size is the granularity
+   memory is reserved and bound at, a power of two of at least 2MB, 0
+   for the default. */
+struct nusa_arena *nusa_arena_create(int policy, struct bitmask *nodes,
+				     size_t chunk_size)
+{
+	return arena_create(policy, nodes, -1, chunk_size);
+}
+
+/* Create an arena on node, placed like nusa_alloc_onnode */
+struct nusa_arena *nusa_arena_create_onnode(int node)
+{
+	if (node < 0 || node > nusa_max_node()) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return arena_create(MPOL_BIND, NULL, node, 0);
+}
+
+void *nusa_arena_alloc(struct nusa_arena *a, size_t size)
+{
+	struct arena_cache *cache;
+	struct arena_bin *bin;
+	unsigned c;
+	void *obj;
+
+	if (size > NUSA_ARENA_MAX_SIZE) {
+		errno = EINVAL;
+		return NULL;
+	}
+	c = size_class[(size + ARENA_ALIGN - 1) / ARENA_ALIGN];
+	cache = get_cache(a);
+	if (!cache)
+		return NULL;
+	bin = &cache->bin[c];
+	if (__builtin_expect(!bin->head, 0)) {
+		pthread_mutex_lock(&a->lock);
+		refill(a, bin, c, cache_limit(c) / 2);
+		pthread_mutex_unlock(&a->lock);
+		if (!bin->head) {
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+	obj = bin->head;
+	bin->head = *(void **)obj;
+	bin->count--;
+	return obj;
+}
+
+/* Free an object allocated from a. Any thread may free it. */
+void nusa_arena_free(struct nusa_arena *a, void *obj)
+{
+	struct arena_chunk *ch;
+	struct arena_cache *cache;
+	struct arena_bin *bin;
+	unsigned c;
+
+	if (!obj)
+		return;
+	ch = (struct arena_chunk *)((uintptr_t)obj & ~(a->chunk_size - 1));
+	c = ch->slab_class[((char *)obj - (char *)ch) / ARENA_SLAB];
+	cache = get_cache(a);
+	if (!cache) {
+		/* no cache: hand it back directly */
+		pthread_mutex_lock(&a->lock);
+		*(void **)obj = a->bin[c].head;
+		a->bin[c].head = obj;
+		a->bin[c].count++;
+		pthread_mutex_unlock(&a->lock);
+		return;
+	}
+	bin = &cache->bin[c];
+	*(void **)obj = bin->head;
+	bin->head = obj;
+	if (__builtin_expect(++bin->count > cache_limit(c), 0)) {
+		pthread_mutex_lock(&a->lock);
+		drain(a, bin, c, bin->count / 2);
+		pthread_mutex_unlock(&a->lock);
+	}
+}
+
+/* Release all memory of the arena at once. No thread may use it
+   any more. */
+void nusa_arena_destroy(struct nusa_arena *a)
+{
+	struct arena_chunk *ch, *next;
+	struct arena_cache *cache, *cnext;
+
+	if (!a)
+		return;
+	pthread_key_delete(a->key);
+	for (cache = a->caches; cache; cache = cnext) {
+		cnext = cache->next;
+		free(cache);
+	}
+	for (ch = a->chunks; ch; ch = next) {
+		next = ch->next;
+		munmap(ch, a->chunk_size);
+	}
+	if (a->nodes)
+		nusa_bitmask_free(a->nodes);
+	pthread_mutex_destroy(&a->lock);
+	free(a);
+}
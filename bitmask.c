@@ -0,0 +1,351 @@
+/* Word level bitmask helpers.
+
+   libnusa is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; version
+   2.1.
+
+   libnusa is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should find a copy of v2.1 of the GNU Lesser General Public License
+   somewhere on your Linux system; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA */
+#define _GNU_SOURCE 1
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "nusa.h"
+#include "nusaext.h"
+#include "nusaint.h"
+#include "bitmask.h"
+
+#define WORD(bit)	((bit) / BITS_PER_LONG)
+#define BITOFF(bit)	((bit) % BITS_PER_LONG)
+
+/* Set bits lo..hi inclusive, a word at a time. */
+hidden void bitmask_set_range(struct bitmask *mask, unsigned lo, unsigned hi)
+{
+	unsigned long *p = mask->maskp;
+	unsigned lw = WORD(lo), hw = WORD(hi);
+	unsigned long lmask = ~0UL << BITOFF(lo);
+	unsigned long hmask = ~0UL >> (BITS_PER_LONG - 1 - BITOFF(hi));
+
+	if (lw == hw) {
+		p[lw] |= lmask & hmask;
+		return;
+	}
+	p[lw++] |= lmask;
+	while (lw < hw)
+		p[lw++] = ~0UL;
+	p[hw] |= hmask;
+}
+
+static const char *parse_dec(const char *s, unsigned *val)
+{
+	unsigned v = 0;
+	const char *start = s;
+
+	while (*s >= '0' && *s <= '9') {
+		if (v > (UINT32_MAX - 9) / 10)
+			return NULL;
+		v = v * 10 + (*s++ - '0');
+	}
+	if (s == start)
+		return NULL;
+	*val = v;
+	return s;
+}
+
+/* Parse a range list as in cpulist/nodelist ("0-63,128-191") and set the
+   bits in mask. Bits already set stay set. Returns 0 or -1 with errno
+   set for syntax errors and bits beyond the mask. */
+hidden int bitmask_parse_list(const char *s, struct bitmask *mask)
+{
+	unsigned lo, hi;
+
+	while (*s == ' ' || *s == '\t')
+		s++;
+	if (*s == '\n' || *s == 0)
+		return 0;
+	for (;;) {
+		s = parse_dec(s, &lo);
+		if (!s)
+			goto inval;
+		hi = lo;
+		if (*s == '-') {
+			s = parse_dec(s + 1, &hi);
+			if (!s || hi < lo)
+				goto inval;
+		}
+		if (hi >= mask->size) {
+			errno = ERANGE;
+			return -1;
+		}
+		bitmask_set_range(mask, lo, hi);
+		if (*s != ',')
+			break;
+		s++;
+	}
+	while (*s == ' ' || *s == '\t' || *s == '\n')
+		s++;
+	if (*s == 0)
+		return 0;
+inval:
+	errno = EINVAL;
+	return -1;
+}
+
+static const signed char hexval[256] = {
+	[0 ... 255] = -1,
+	['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4,
+	['5'] = 5, ['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+	['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+	['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+};
+
+/* Decode 8 hex digits (most significant first) in one 64bit word:
+   turn each ASCII byte into its nibble, then fold the nibbles together.
+   The digits must have been validated already. */
+static uint32_t hex8(const char *s)
+{
+	uint64_t v;
+
+	memcpy(&v, s, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	/* '0'-'9' are 0x3X, 'a'-'f' and 'A'-'F' are 0x6X/0x4X with X 1-6 */
+	v = (v & 0x0f0f0f0f0f0f0f0fULL) + 9 * ((v >> 6) & 0x0101010101010101ULL);
+	/* first digit is in the lowest byte: pair it with the next one */
+	v = ((v & 0x000f000f000f000fULL) << 4) | ((v >> 8) & 0x000f000f000f000fULL);
+	v = (v | (v >> 8)) & 0x0000ffff0000ffffULL;
+	v = (v | (v >> 16)) & 0xffffffffULL;
+	return __builtin_bswap32((uint32_t)v);
+}
+
+/* Or val into the mask at bit offset off. */
+static int or_bits(struct bitmask *mask, unsigned long off, uint32_t val)
+{
+	unsigned long words = longsperbits(mask->size);
+	unsigned long w = WORD(off), sh = BITOFF(off);
+
+	if (!val)
+		return 0;
+	if (off + 32 - __builtin_clz(val) > mask->size)
+		return -1;
+	mask->maskp[w] |= (unsigned long)val << sh;
+	if (sh + 32 > BITS_PER_LONG && w + 1 < words)
+		mask->maskp[w + 1] |= (unsigned long)val >> (BITS_PER_LONG - sh);
+	return 0;
+}
+
+/* Parse a hex mask as in /proc/self/status ("ff,ffffffff", most
+   significant group first) and set the bits in mask. Full groups of 8
+   digits are decoded a word at a time. Returns 0 or -1 with errno set. */
+hidden int bitmask_parse_hex(const char *s, struct bitmask *mask)
+{
+	const char *end, *p;
+	unsigned long off = 0;
+
+	while (*s == ' ' || *s == '\t')
+		s++;
+	for (end = s; *end && *end != '\n' && *end != ' '; end++)
+		if (hexval[(unsigned char)*end] < 0 && *end != ',')
+			goto inval;
+	if (end == s)
+		goto inval;
+
+	/* Walk the groups from the least significant end */
+	p = end;
+	while (p > s) {
+		const char *g = p;
+
+		while (g > s && g[-1] != ',')
+			g--;
+		if (g == p)
+			goto inval;
+		while (p - g >= 8) {
+			p -= 8;
+			if (or_bits(mask, off, hex8(p)) < 0)
+				goto range;
+			off += 32;
+		}
+		if (p > g) {
+			const char *q;
+			uint32_t v = 0;
+			int n = p - g;
+
+			for (q = g; q < p; q++)
+				v = (v << 4) | hexval[(unsigned char)*q];
+			if (or_bits(mask, off, v) < 0)
+				goto range;
+			off += 4 * n;
+		}
+		/* every group but the leading one is 32 bits wide, however
+		   many digits it was written with */
+		off = (off + 31) & ~31UL;
+		p = g;
+		if (p > s)
+			p--;	/* skip the comma */
+		if (p == s && *p == ',')
+			goto inval;
+	}
+	return 0;
+range:
+	errno = ERANGE;
+	return -1;
+inval:
+	errno = EINVAL;
+	return -1;
+}
+
+/* Exported word level operations. Masks of different sizes are allowed:
+   bits beyond the end of a source count as clear, bits beyond the end of
+   dst are dropped. dst may be the same as either source. */
+
+static inline unsigned long word_of(const struct bitmask *bmp, unsigned long w)
+{
+	return w < longsperbits(bmp->size) ? bmp->maskp[w] : 0;
+}
+
+/* Clear the bits past size in the last word, so that weight and
+   equal see a clean mask. */
+static void clear_tail(struct bitmask *bmp)
+{
+	if (BITOFF(bmp->size))
+		bmp->maskp[WORD(bmp->size)] &= ~(~0UL << BITOFF(bmp->size));
+}
+
+struct bitmask *nusa_bitmask_and(struct bitmask *dst,
+				 const struct bitmask *a,
+				 const struct bitmask *b)
+{
+	unsigned long w, n = longsperbits(dst->size);
+
+	for (w = 0; w < n; w++)
+		dst->maskp[w] = word_of(a, w) & word_of(b, w);
+	clear_tail(dst);
+	return dst;
+}
+
+struct bitmask *nusa_bitmask_or(struct bitmask *dst,
+				const struct bitmask *a,
+				const struct bitmask *b)
+{
+	unsigned long w, n = longsperbits(dst->size);
+
+	for (w = 0; w < n; w++)
+		dst->maskp[w] = word_of(a, w) | word_of(b, w);
+	clear_tail(dst);
+	return dst;
+}
+
+struct bitmask *nusa_bitmask_andnot(struct bitmask *dst,
+				    const struct bitmask *a,
+				    const struct bitmask *b)
+{
+	unsigned long w, n = longsperbits(dst->size);
+
+	for (w = 0; w < n; w++)
+		dst->maskp[w] = word_of(a, w) & ~word_of(b, w);
+	clear_tail(dst);
+	return dst;
+}
+
+/* Return the first set bit at or after bit, or -1. */
+int nusa_bitmask_next(const struct bitmask *bmp, int bit)
+{
+	unsigned long w, n = longsperbits(bmp->size);
+	unsigned long v;
+
+	if (bit < 0)
+		bit = 0;
+	if ((unsigned)bit >= bmp->size)
+		return -1;
+	w = WORD(bit);
+	v = bmp->maskp[w] & (~0UL << BITOFF(bit));
+	while (!v) {
+		if (++w >= n)
+			return -1;
+		v = bmp->maskp[w];
+	}
+	bit = w * BITS_PER_LONG + __builtin_ctzl(v);
+	return (unsigned)bit < bmp->size ? bit : -1;
+}
+
+/* Return the last set bit at or before bit, or -1. */
+int nusa_bitmask_prev(const struct bitmask *bmp, int bit)
+{
+	unsigned long w, v;
+
+	if (bit < 0)
+		return -1;
+	if ((unsigned)bit >= bmp->size)
+		bit = bmp->size - 1;
+	w = WORD(bit);
+	v = bmp->maskp[w] & (~0UL >> (BITS_PER_LONG - 1 - BITOFF(bit)));
+	while (!v) {
+		if (w-- == 0)
+			return -1;
+		v = bmp->maskp[w];
+	}
+	return w * BITS_PER_LONG + BITS_PER_LONG - 1 - __builtin_clzl(v);
+}
+
+/* Set bits lo..hi inclusive. Returns bmp, or NULL for a bad range. */
+struct bitmask *nusa_bitmask_setrange(struct bitmask *bmp,
+				      unsigned int lo, unsigned int hi)
+{
+	if (lo > hi || hi >= bmp->size) {
+		errno = EINVAL;
+		return NULL;
+	}
+	bitmask_set_range(bmp, lo, hi);
+	return bmp;
+}
+
+/* Return the first clear bit at or after bit, or size. */
+static int next_clear(const struct bitmask *bmp, int bit)
+{
+	unsigned long w = WORD(bit), n = longsperbits(bmp->size);
+	unsigned long v = ~bmp->maskp[w] & (~0UL << BITOFF(bit));
+
+	while (!v) {
+		if (++w >= n)
+			return bmp->size;
+		v = ~bmp->maskp[w];
+	}
+	bit = w * BITS_PER_LONG + __builtin_ctzl(v);
+	return (unsigned)bit < bmp->size ? bit : (int)bmp->size;
+}
+
+/* Format bmp as a range list ("0-3,8,10-11") into buf, always 0
+   terminated when len > 0. Returns the length of the full string like
+   snprintf, so a result >= len means it was truncated. */
+int nusa_bitmask_format_list(const struct bitmask *bmp, char *buf, size_t len)
+{
+	int lo, hi, n, total = 0;
+	char *p = buf;
+
+	if (len)
+		*p = 0;
+	for (lo = nusa_bitmask_next(bmp, 0); lo >= 0;
+	     lo = nusa_bitmask_next(bmp, hi + 1)) {
+		hi = next_clear(bmp, lo) - 1;
+		n = snprintf(p, len, lo == hi ? "%s%d" : "%s%d-%d",
+			     total ? "," : "", lo, hi);
+		total += n;
+		if ((size_t)n < len) {
+			p += n;
+			len -= n;
+		} else if (len) {
+			p += len - 1;
+			len = 1;
+		}
+	}
+	return total;
+}
@@ -0,0 +1,5 @@
+struct bitmask;
+
+hidden int bitmask_parse_list(const char *s, struct bitmask *mask);
+hidden int bitmask_parse_hex(const char *s, struct bitmask *mask);
+hidden void bitmask_set_range(struct bitmask *mask, unsigned lo, unsigned hi);
@@ -0,0 +1,372 @@
+/* Parallel node aware bulk copy and fill.
+
+   libnusa is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; version
+   2.1.
+
+   libnusa is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should find a copy of v2.1 of the GNU Lesser General Public License
+   somewhere on your Linux system; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+   The range is cut into chunks and each chunk runs on a thread of the
+   node its destination is on. When the destination is not faulted in
+   yet, its memory policy (or the caller's, when the range has none)
+   says which node the first touch will place it on. Threads only start
+   on the nodes that have chunks, at most one per chunk, and never take
+   work from another node, so first touch lands where the policy wants
+   it. Reads may cross the interconnect, the writes stay local, and
+   every node's memory controllers work at the same time.
+
+   Large operations bypass the caches with non temporal stores where
+   the cpu has them: the data is not read again soon, and streaming it
+   through the caches would evict everything else and cost an extra
+   read of each destination line. */
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "nusa.h"
+#include "nusaif.h"
+#include "nusaint.h"
+#include "nusaext.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define BULK_CHUNK	(8UL << 20)	/* work unit */
+#define BULK_PARALLEL_MIN (32UL << 20)	/* smaller runs in the caller */
+#define BULK_NT_MIN	(4UL << 20)	/* roughly beyond the last level cache */
+
+struct bulk_chunk {
+	char *dst;
+	const char *src;	/* NULL for fill */
+	size_t len;
+	int c;
+	int nt;
+	int node;	/* node to run on, -1 for anywhere */
+};
+
+/* The chunks of one node, taken in turn by its threads */
+struct bulk_group {
+	struct bulk_chunk *chunks;
+	unsigned long n;
+	unsigned long next;
+	int node;
+};
+
+struct bulk_worker {
+	struct bulk_group *g;
+	pthread_t thread;
+	int started;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#ifdef __SSE2__
+static void copy_nt(char *dst, const char *src, size_t len)
+{
+	size_t head = -(unsigned long)dst & 15;
+
+	if (head > len)
+		head = len;
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	len -= head;
+	for (; len >= 64; len -= 64, dst += 64, src += 64) {
+		__m128i a = _mm_loadu_si128((const __m128i *)src);
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+		__m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+
+		_mm_stream_si128((__m128i *)dst, a);
+		_mm_stream_si128((__m128i *)(dst + 16), b);
+		_mm_stream_si128((__m128i *)(dst + 32), c);
+		_mm_stream_si128((__m128i *)(dst + 48), d);
+	}
+	memcpy(dst, src, len);
+	/* streaming stores are weakly ordered, make them visible before
+	   the chunk is reported done */
+	_mm_sfence();
+}
+
+static void fill_nt(char *dst, int c, size_t len)
+{
+	size_t head = -(unsigned long)dst & 15;
+	__m128i v = _mm_set1_epi8((char)c);
+
+	if (head > len)
+		head = len;
+	memset(dst, c, head);
+	dst += head;
+	len -= head;
+	for (; len >= 64; len -= 64, dst += 64) {
+		_mm_stream_si128((__m128i *)dst, v);
+		_mm_stream_si128((__m128i *)(dst + 16), v);
+		_mm_stream_si128((__m128i *)(dst + 32), v);
+		_mm_stream_si128((__m128i *)(dst + 48), v);
+	}
+	memset(dst, c, len);
+	_mm_sfence();
+}
+#else
+#define copy_nt memcpy
+#define fill_nt memset
+#endif
+
+static void bulk_task(void *arg)
+{
+	struct bulk_chunk *ch = arg;
+
+	if (ch->src) {
+		if (ch->nt)
+			copy_nt(ch->dst, ch->src, ch->len);
+		else
+			memcpy(ch->dst, ch->src, ch->len);
+	} else {
+		if (ch->nt)
+			fill_nt(ch->dst, ch->c, ch->len);
+		else
+			memset(ch->dst, ch->c, ch->len);
+	}
+}
+
+/* Node of the page holding each chunk start, -1 when not present */
+static void chunk_nodes(const char *start, unsigned long n, int *status)
+{
+	size_t page = getpagesize();
+	void **pages = malloc(n * sizeof(void *));
+	unsigned long i;
+
+	if (pages) {
+		for (i = 0; i < n; i++)
+			pages[i] = (void *)((unsigned long)(start + i * BULK_CHUNK) &
+					    ~(page - 1));
+		if (move_pages(0, n, pages, NULL, status, 0) == 0) {
+			free(pages);
+			return;
+		}
+		free(pages);
+	}
+	for (i = 0; i < n; i++)
+		status[i] = -1;
+}
+
+/* n-th node set in mask */
+static int nth_node(struct bitmask *mask, unsigned long n)
+{
+	int i;
+
+	for (i = 0; i < (int)mask->size; i++)
+		if (nusa_bitmask_isbitset(mask, i) && n-- == 0)
+			return i;
+	return -1;
+}
+
+/* Node the first touch of chunk i at addr from a thread of node self
+   will place its pages on. */
+static int policy_node(const char *addr, struct bitmask *mask,
+		       unsigned long i, int self)
+{
+	int policy, k, node, w;
+
+	if (get_prampolicy(&policy, mask->maskp, mask->size + 1,
+			   (void *)addr, MPOL_F_ADDR) < 0)
+		return self;
+	/* No policy for the range, the thread's applies */
+	if (policy == MPOL_DEFAULT &&
+	    get_prampolicy(&policy, mask->maskp, mask->size + 1, NULL, 0) < 0)
+		return self;
+	w = nusa_bitmask_weight(mask);
+	if (w == 0)
+		return self;
+
+	switch (policy) {
+	case MPOL_INTERLEAVE:
+	case MPOL_WEIGHTED_INTERLEAVE:
+		/* Placement does not depend on who touches, spread the
+		   chunks over the nodes */
+		return nth_node(mask, i % w);
+	case MPOL_BIND:
+	case MPOL_PREFERRED_MANY:
+		/* The kernel takes the node of the mask nearest to the
+		   toucher */
+		for (k = 0; self >= 0 && (node = nusa_nearest_node(self, k)) >= 0;
+		     k++)
+			if (nusa_bitmask_isbitset(mask, node))
+				return node;
+		return nth_node(mask, 0);
+	case MPOL_PREFERRED:
+		return nth_node(mask, 0);
+	default:
+		return self;
+	}
+}
+
+static int cmp_node(const void *a, const void *b)
+{
+	const struct bulk_chunk *x = a, *y = b;
+
+	return x->node - y->node;
+}
+
+static void bulk_drain(struct bulk_group *g)
+{
+	unsigned long k;
+
+	while ((k = __sync_fetch_and_add(&g->next, 1)) < g->n)
+		bulk_task(&g->chunks[k]);
+}
+
+static void *bulk_thread(void *arg)
+{
+	struct bulk_group *g = arg;
+
+	if (g->node >= 0)
+		nusa_run_on_node(g->node);
+	bulk_drain(g);
+	return NULL;
+}
+
+/* Threads for the n chunks of node: one per cpu of the node, but not
+   more than there are chunks */
+static unsigned long group_threads(int node, unsigned long n)
+{
+	struct bitmask *cpus = nusa_allocate_cpumask();
+	unsigned long t = 0;
+
+	if (node >= 0 && nusa_node_to_cpus(node, cpus) == 0)
+		t = nusa_bitmask_weight(cpus);
+	/* nodes without cpus: the toucher does not matter */
+	if (t == 0)
+		t = sysconf(_SC_NPROCESSORS_ONLN);
+	nusa_bitmask_free(cpus);
+	if (t > n)
+		t = n;
+	return t > 0 ? t : 1;
+}
+
+static int bulk_run(char *dst, const char *src, int c, size_t len,
+		    struct nusa_bulk_stats *st)
+{
+	unsigned long i, k, n = (len + BULK_CHUNK - 1) / BULK_CHUNK;
+	unsigned long ngroups = 0, nworkers = 0;
+	struct bulk_chunk *chunks = NULL;
+	struct bulk_group *groups = NULL;
+	struct bulk_worker *workers = NULL;
+	struct bitmask *nodes = NULL;
+	int *dnode = NULL;
+	int nt = len >= BULK_NT_MIN;
+	double start = now();
+	int self, ret = -1;
+
+	if (st)
+		memset(st, 0, sizeof(struct nusa_bulk_stats));
+	if (len < BULK_PARALLEL_MIN || nusa_available() < 0) {
+		struct bulk_chunk one = { dst, src, len, c, nt, -1 };
+
+		bulk_task(&one);
+		ret = 0;
+		n = len ? 1 : 0;
+		goto out;
+	}
+
+	chunks = malloc(n * sizeof(struct bulk_chunk));
+	groups = malloc(n * sizeof(struct bulk_group));
+	workers = malloc(n * sizeof(struct bulk_worker));
+	dnode = malloc(n * sizeof(int));
+	nodes = nusa_allocate_nodemask();
+	if (!chunks || !groups || !workers || !dnode || !nodes) {
+		errno = ENOMEM;
+		goto out;
+	}
+	chunk_nodes(dst, n, dnode);
+	self = nusa_current_node();
+	for (i = 0; i < n; i++) {
+		struct bulk_chunk *ch = &chunks[i];
+
+		ch->dst = dst + i * BULK_CHUNK;
+		ch->src = src ? src + i * BULK_CHUNK : NULL;
+		ch->len = i == n - 1 ? len - i * BULK_CHUNK : BULK_CHUNK;
+		ch->c = c;
+		ch->nt = nt;
+		ch->node = dnode[i] >= 0 ? dnode[i] :
+			   policy_node(ch->dst, nodes, i, self);
+	}
+	nusa_bitmask_clearall(nodes);
+
+	qsort(chunks, n, sizeof(struct bulk_chunk), cmp_node);
+	for (i = 0; i < n; i = k) {
+		struct bulk_group *g = &groups[ngroups++];
+
+		for (k = i + 1; k < n && chunks[k].node == chunks[i].node; k++)
+			;
+		g->chunks = &chunks[i];
+		g->n = k - i;
+		g->next = 0;
+		g->node = chunks[i].node;
+		if (g->node >= 0)
+			nusa_bitmask_setbit(nodes, g->node);
+	}
+	for (i = 0; i < ngroups; i++) {
+		unsigned long t = group_threads(groups[i].node, groups[i].n);
+
+		for (k = 0; k < t; k++, nworkers++) {
+			struct bulk_worker *w = &workers[nworkers];
+
+			w->g = &groups[i];
+			w->started = !pthread_create(&w->thread, NULL,
+						     bulk_thread, w->g);
+		}
+	}
+	for (i = 0; i < nworkers; i++) {
+		if (workers[i].started)
+			pthread_join(workers[i].thread, NULL);
+		else	/* do it ourselves, without changing our affinity */
+			bulk_drain(workers[i].g);
+	}
+	ret = 0;
+out:
+	if (st && ret == 0) {
+		st->bytes = len;
+		st->seconds = now() - start;
+		st->bytes_per_sec = st->seconds > 0 ? len / st->seconds : 0;
+		st->chunks = n;
+		st->nodes = nodes ? nusa_bitmask_weight(nodes) : 0;
+	}
+	if (nodes)
+		nusa_bitmask_free(nodes);
+	free(chunks);
+	free(groups);
+	free(workers);
+	free(dnode);
+	return ret;
+}
+
+/* Copy len bytes from src to dst, which must not overlap. */
+int nusa_bulk_copy(void *dst, const void *src, size_t len,
+		   struct nusa_bulk_stats *st)
+{
+	return bulk_run(dst, src, 0, len, st);
+}
+
+/* Set len bytes at dst to c. */
+int nusa_bulk_fill(void *dst, int c, size_t len, struct nusa_bulk_stats *st)
+{
+	return bulk_run(dst, NULL, c, len, st);
+}
@@ -20,50 +20,138 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
+#include <pthread.h>
 #include "nusa.h"
+#include "nusaext.h"
 #include "nusaint.h"
+#include "snapshot.h"
+#include "sysfs.h"
+#include "topology.h"
 
 static int distance_numnodes;
 static int *distance_table;
+static int distance_nnodes;	/* nodes with distance information */
+static int *neighbour_table;	/* per node: nodes sorted by distance */
+static int *hop_table;		/* per node pair: rank of the distance */
+static pthread_once_t distance_once = PTHREAD_ONCE_INIT;
 
+/* The distance file of a node lists the distances to all online nodes
+   in order, which need not be contiguous. */
 static void parse_numbers(char *s, int *iptr)
 {
-	int i, d, j;
+	const struct bitmask *online = topo_nodes();
+	int j, d;
 	char *end;
-	int maxnode = nusa_max_node();
-	int numnodes = 0;
+	int maxnode = topo_num_nodes();
 
-	for (i = 0; i <= maxnode; i++)
-		if (nusa_bitmask_isbitset(nusa_nodes_ptr, i))
-			numnodes++;
-
-	for (i = 0, j = 0; i <= maxnode; i++, j++) {
+	for (j = 0; online && j < maxnode; j++) {
+		if (!nusa_bitmask_isbitset(online, j))
+			continue;
 		d = strtoul(s, &end, 0);
-		/* Skip unavailable nodes */
-		while (j<=maxnode && !nusa_bitmask_isbitset(nusa_nodes_ptr, j))
-			j++;
 		if (s == end)
 			break;
-		*(iptr+j) = d;
+		iptr[j] = d;
 		s = end;
 	}
 }
 
-static int read_distance_table(void)
+static int *sort_node;		/* row the comparison sorts by */
+
+static int cmp_distance(const void *a, const void *b)
+{
+	int na = *(const int *)a, nb = *(const int *)b;
+
+	if (sort_node[na] != sort_node[nb])
+		return sort_node[na] - sort_node[nb];
+	return na - nb;
+}
+
+/* Sort the nodes by distance from each node and rank the distinct
+   distances into hop groups (0 for the node itself). Only called under
+   distance_once, so the static sort_node is safe. */
+static int build_neighbours(int *table, int maxnode)
+{
+	int i, j, n = 0;
+	int *nodes, *nb, *hops;
+
+	nodes = malloc(maxnode * sizeof(int));
+	nb = malloc(maxnode * maxnode * sizeof(int));
+	hops = malloc(maxnode * maxnode * sizeof(int));
+	if (!nodes || !nb || !hops) {
+		free(nodes);
+		free(nb);
+		free(hops);
+		return -1;
+	}
+	for (i = 0; i < maxnode; i++)
+		if (table[i * maxnode + i])
+			nodes[n++] = i;
+
+	for (i = 0; i < maxnode * maxnode; i++) {
+		nb[i] = -1;
+		hops[i] = -1;
+	}
+	for (i = 0; i < n; i++) {
+		int a = nodes[i], rank = 0;
+		int *row = nb + a * maxnode;
+
+		memcpy(row, nodes, n * sizeof(int));
+		sort_node = table + a * maxnode;
+		qsort(row, n, sizeof(int), cmp_distance);
+		for (j = 0; j < n; j++) {
+			if (j > 0 && sort_node[row[j]] != sort_node[row[j-1]])
+				rank++;
+			hops[a * maxnode + row[j]] = rank;
+		}
+	}
+	free(nodes);
+	distance_nnodes = n;
+	neighbour_table = nb;
+	hop_table = hops;
+	return 0;
+}
+
+/* Take the distances from the topology snapshot when there is a valid
+   one, saving a sysfs file per node. */
+static int *snapshot_distance_table(int maxnode)
+{
+	const struct topo_snapshot *snap = topo_snapshot();
+	const int32_t *dist;
+	int *table;
+	int i, j;
+
+	if (!snap || snap->nnodes != maxnode)
+		return NULL;
+	table = calloc(maxnode * maxnode, sizeof(int));
+	if (!table)
+		return NULL;
+	dist = SNAPSHOT_ARRAY(snap, int32_t, distance_off);
+	for (i = 0; i < maxnode; i++)
+		for (j = 0; j < maxnode; j++)
+			table[i * maxnode + j] = dist[i * maxnode + j];
+	return table;
+}
+
+static void read_distance_table(void)
 {
 	int nd, len;
-	char *line = NULL;
-	size_t linelen = 0;
-	int maxnode = nusa_max_node() + 1;
+	char line[SYSFS_BLOCK];
+	int maxnode = topo_num_nodes();
 	int *table = NULL;
 	int err = -1;
 
+	table = snapshot_distance_table(maxnode);
+	if (table) {
+		err = 0;
+		goto out;
+	}
+
 	for (nd = 0;; nd++) {
-		char fn[100];
-		FILE *dfh;
-		sprintf(fn, "/sys/devices/system/node/node%d/distance", nd);
-		dfh = fopen(fn, "r");
-		if (!dfh) {
+		char fn[32];
+		sprintf(fn, "node%d/distance", nd);
+		len = sysfs_read_dir(SYSFS_NODE_DIR, fn, line, sizeof line);
+		if (len < 0) {
 			if (errno == ENOENT)
 				err = 0;
 			if (!err && nd<maxnode)
@@ -71,9 +159,7 @@ static int read_distance_table(void)
 			else
 				break;
 		}
-		len = getdelim(&line, &linelen, '\n', dfh);
-		fclose(dfh);
-		if (len <= 0)
+		if (len == 0)
 			break;
 
 		if (!table) {
@@ -86,35 +172,52 @@ static int read_distance_table(void)
 
 		parse_numbers(line, table + nd * maxnode);
 	}
-	free(line);
+out:
+	if (!err && table && build_neighbours(table, maxnode) < 0) {
+		errno = ENOMEM;
+		err = -1;
+	}
 	if (err)  {
 		nusa_warn(W_distance,
 			  "Cannot parse distance information in sysfs: %s",
 			  strerror(errno));
 		free(table);
-		return err;
-	}
-	/* Update the global table pointer.  Race window here with
-	   other threads, but in the worst case we leak one distance
-	   array one time, which is tolerable. This avoids a
-	   dependency on pthreads. */
-	if (distance_table) {
-		free(table);
-		return 0;
+		return;
 	}
+	/* Published under distance_once, so other threads see the
+	   complete tables. */
 	distance_numnodes = maxnode;
 	distance_table = table;
-	return 0;
 }
 
 int nusa_distance(int a, int b)
 {
-	if (!distance_table) {
-		int err = read_distance_table();
-		if (err < 0)
-			return 0;
-	}
+	pthread_once(&distance_once, read_distance_table);
+	if (!distance_table)
+		return 0;
 	if ((unsigned)a >= distance_numnodes || (unsigned)b >= distance_numnodes)
 		return 0;
 	return distance_table[a * distance_numnodes + b];
 }
+
+/* Return the k-th nearest node to node, the node itself for k == 0.
+   Ties are broken by node number. Returns -1 when there is no such node. */
+int nusa_nearest_node(int node, int k)
+{
+	pthread_once(&distance_once, read_distance_table);
+	if (!neighbour_table || (unsigned)node >= distance_numnodes ||
+	    (unsigned)k >= distance_nnodes)
+		return -1;
+	return neighbour_table[node * distance_numnodes + k];
+}
+
+/* Return the hop group of b as seen from a: 0 for a itself, 1 for the
+   nodes at the smallest distance, and so on. -1 for unknown nodes. */
+int nusa_node_hops(int a, int b)
+{
+	pthread_once(&distance_once, read_distance_table);
+	if (!hop_table || (unsigned)a >= distance_numnodes ||
+	    (unsigned)b >= distance_numnodes)
+		return -1;
+	return hop_table[a * distance_numnodes + b];
+}
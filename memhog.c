@@ -23,6 +23,7 @@
 #include <stdbool.h>
 #include "nusa.h"
 #include "nusaif.h"
+#include "nusaext.h"
 #include "util.h"
 
 #define terr(x) perror(x)
@@ -104,7 +105,7 @@ int main(int ac, char **av)
 	} else
 		loose = 1;
 	policy = parse_policy(av[2], av[3]);
-	if (policy != MPOL_DEFAULT)
+	if (policy != MPOL_DEFAULT && policy != MPOL_LOCAL)
 		nodes = nusa_parse_nodestring(av[3]);
         if (!nodes) {
 		printf ("<%s> is invalid\n", av[3]);
@@ -0,0 +1,492 @@
+/* Asynchronous page migration.
+
+   libnusa is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; version
+   2.1.
+
+   libnusa is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should find a copy of v2.1 of the GNU Lesser General Public License
+   somewhere on your Linux system; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+   Requests are queued by priority and a few background threads, started
+   on first use, take them apart in batches of MIGRATE_BATCH pages, one
+   move_pages call each. A worker picks the next batch from the highest
+   priority request every time, so a new urgent request overtakes a long
+   running one at the next batch boundary, and several workers can move
+   batches of one large request at the same time. Cancel takes effect
+   at batch boundaries too.
+
+   A forked child has none of the workers. Handles it inherited that
+   were not finished at the fork are marked cancelled in the child, so
+   waiting on them returns at once. Their eventfd is still shared with
+   the parent and only reports the parent's migration. */
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "nusa.h"
+#include "nusaif.h"
+#include "nusaint.h"
+#include "nusaext.h"
+
+#define MIGRATE_BATCH	512	/* pages per move_pages call */
+#define MIGRATE_WORKERS	2	/* default, $NUSA_MIGRATE_THREADS */
+
+struct nusa_migration {
+	struct nusa_migration *next;	/* queue, highest priority first */
+	struct nusa_migration *next_live; /* all handles not freed yet */
+	char *start;
+	unsigned long npages, taken;	/* batches hand out pages [taken..) */
+	int pid;			/* -1 for a range */
+	struct bitmask *from, *to;	/* process migration */
+	int node;
+	int prio;
+	int flags;
+	int running;			/* batches in flight */
+	int queued;
+	int cancel;
+	int done;
+	int error;			/* first errno seen */
+	unsigned long moved, failed;
+	int efd;
+	nusa_migration_cb cb;
+	void *arg;
+	pthread_cond_t finished;
+};
+
+static pthread_mutex_t mig_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mig_work = PTHREAD_COND_INITIALIZER;
+static struct nusa_migration *mig_queue;
+static struct nusa_migration *mig_live;
+static int mig_atfork;
+static pid_t mig_pid;			/* process the workers run in */
+static int mig_workers;
+static size_t mig_pagesize;
+
+static void enqueue(struct nusa_migration *m)
+{
+	struct nusa_migration **p = &mig_queue;
+
+	/* behind the requests of the same priority */
+	while (*p && (*p)->prio >= m->prio)
+		p = &(*p)->next;
+	m->next = *p;
+	*p = m;
+	m->queued = 1;
+}
+
+static void dequeue(struct nusa_migration *m)
+{
+	struct nusa_migration **p = &mig_queue;
+
+	while (*p && *p != m)
+		p = &(*p)->next;
+	if (*p)
+		*p = m->next;
+	m->queued = 0;
+}
+
+/* Called with mig_lock held when the last batch finished */
+static void finish(struct nusa_migration *m)
+{
+	nusa_migration_cb cb = m->cb;
+
+	if (cb) {
+		pthread_mutex_unlock(&mig_lock);
+		cb(m, m->arg);
+		pthread_mutex_lock(&mig_lock);
+	}
+	m->done = 1;
+	if (m->efd >= 0) {
+		uint64_t one = 1;
+
+		if (write(m->efd, &one, sizeof(one)) < 0)
+			m->error = m->error ? m->error : errno;
+	}
+	pthread_cond_broadcast(&m->finished);
+}
+
+static void run_pages(struct nusa_migration *m, unsigned long first,
+		      unsigned long n, void **pages, int *nodes, int *status)
+{
+	unsigned long i, moved = 0, failed = 0;
+	int err = 0;
+
+	for (i = 0; i < n; i++) {
+		pages[i] = m->start + (first + i) * mig_pagesize;
+		nodes[i] = m->node;
+	}
+	if (move_pages(0, n, pages, nodes, status, m->flags) < 0) {
+		err = errno;
+		failed = n;
+	} else {
+		/* pages that were never touched have nothing to move */
+		for (i = 0; i < n; i++)
+			if (status[i] == m->node || status[i] == -ENOENT)
+				moved++;
+			else
+				failed++;
+	}
+	pthread_mutex_lock(&mig_lock);
+	m->moved += moved;
+	m->failed += failed;
+	if (err && !m->error)
+		m->error = err;
+	pthread_mutex_unlock(&mig_lock);
+}
+
+static void run_process(struct nusa_migration *m)
+{
+	int ret = nusa_migrate_pages(m->pid, m->from, m->to);
+	int err = ret < 0 ? errno : 0;
+
+	pthread_mutex_lock(&mig_lock);
+	if (ret > 0)
+		m->failed = ret;
+	if (err)
+		m->error = err;
+	pthread_mutex_unlock(&mig_lock);
+}
+
+static void *migrate_worker(void *arg)
+{
+	void **pages = malloc(MIGRATE_BATCH * sizeof(void *));
+	int *nodes = malloc(MIGRATE_BATCH * sizeof(int));
+	int *status = malloc(MIGRATE_BATCH * sizeof(int));
+
+	(void)arg;
+	pthread_mutex_lock(&mig_lock);
+	for (;;) {
+		struct nusa_migration *m;
+		unsigned long first = 0, n = 0;
+
+		while (!mig_queue)
+			pthread_cond_wait(&mig_work, &mig_lock);
+		m = mig_queue;
+		if (m->pid >= 0) {
+			n = 1;
+			dequeue(m);
+		} else {
+			first = m->taken;
+			n = m->npages - first;
+			if (n > MIGRATE_BATCH)
+				n = MIGRATE_BATCH;
+			m->taken += n;
+			if (m->taken == m->npages)
+				dequeue(m);
+		}
+		m->running++;
+		pthread_mutex_unlock(&mig_lock);
+
+		if (m->pid >= 0)
+			run_process(m);
+		else if (pages && nodes && status)
+			run_pages(m, first, n, pages, nodes, status);
+
+		pthread_mutex_lock(&mig_lock);
+		if (!pages || !nodes || !status) {
+			m->failed += n;
+			m->error = ENOMEM;
+		}
+		if (--m->running == 0 && !m->queued)
+			finish(m);
+	}
+	return NULL;
+}
+
+static void free_masks(struct nusa_migration *m)
+{
+	if (m->from)
+		nusa_bitmask_free(m->from);
+	if (m->to)
+		nusa_bitmask_free(m->to);
+}
+
+static void fork_prepare(void)
+{
+	pthread_mutex_lock(&mig_lock);
+}
+
+static void fork_parent(void)
+{
+	pthread_mutex_unlock(&mig_lock);
+}
+
+/* The child has no workers. Nothing will run the copied queue or the
+   batches that were in flight, so finish every handle here, without
+   callbacks or eventfd writes: those belong to the parent. */
+static void fork_child(void)
+{
+	struct nusa_migration *m;
+
+	for (m = mig_live; m; m = m->next_live) {
+		pthread_cond_init(&m->finished, NULL);
+		if (m->done)
+			continue;
+		m->queued = 0;
+		m->running = 0;
+		m->cancel = 1;
+		m->done = 1;
+	}
+	pthread_cond_init(&mig_work, NULL);
+	mig_queue = NULL;
+	mig_workers = 0;
+	mig_pid = 0;
+	pthread_mutex_unlock(&mig_lock);
+}
+
+/* Called with mig_lock held */
+static void start_workers(void)
+{
+	const char *env;
+	pthread_attr_t attr;
+	sigset_t all, old;
+	pthread_t t;
+	int i, n;
+
+	if (mig_pid == getpid())
+		return;
+	if (!mig_atfork &&
+	    pthread_atfork(fork_prepare, fork_parent, fork_child) == 0)
+		mig_atfork = 1;
+	env = secure_getenv("NUSA_MIGRATE_THREADS");
+	n = env ? atoi(env) : MIGRATE_WORKERS;
+	mig_pid = getpid();
+	mig_workers = 0;
+	mig_queue = NULL;
+	mig_pagesize = getpagesize();
+	if (n < 1)
+		n = 1;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	/* The workers inherit the mask: signals go to the caller's
+	   threads, not to ours */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (i = 0; i < n; i++)
+		if (pthread_create(&t, &attr, migrate_worker, NULL) == 0)
+			mig_workers++;
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_attr_destroy(&attr);
+}
+
+static struct nusa_migration *submit(struct nusa_migration *m)
+{
+	pthread_mutex_lock(&mig_lock);
+	start_workers();
+	if (!mig_workers) {
+		pthread_mutex_unlock(&mig_lock);
+		free_masks(m);
+		free(m);
+		errno = EAGAIN;
+		return NULL;
+	}
+	m->efd = -1;
+	pthread_cond_init(&m->finished, NULL);
+	m->next_live = mig_live;
+	mig_live = m;
+	if (m->pid < 0 && m->npages == 0)
+		finish(m);
+	else
+		enqueue(m);
+	pthread_cond_broadcast(&mig_work);
+	pthread_mutex_unlock(&mig_lock);
+	return m;
+}
+
+/* Start moving the pages of [start, start + len) to node. Higher prio
+   runs first, 0 is normal. flags are MPOL_MF_MOVE or MPOL_MF_MOVE_ALL.
+   cb, when not NULL, runs when the migration is finished, before
+   waiters are woken: on a worker thread, or in the caller when it
+   cancels or there is nothing to move. It must not wait for or free
+   its own handle. */
+struct nusa_migration *nusa_migrate_range_async(void *start, size_t len,
+						int node, int prio, int flags,
+						nusa_migration_cb cb,
+						void *arg)
+{
+	struct nusa_migration *m;
+	unsigned long page = getpagesize();
+	unsigned long first = (unsigned long)start & ~(page - 1);
+	unsigned long end = ((unsigned long)start + len + page - 1) &
+			    ~(page - 1);
+
+	if (node < 0 || node > nusa_max_node() ||
+	    (flags & ~(MPOL_MF_MOVE | MPOL_MF_MOVE_ALL))) {
+		errno = EINVAL;
+		return NULL;
+	}
+	m = calloc(1, sizeof(struct nusa_migration));
+	if (!m)
+		return NULL;
+	m->start = (char *)first;
+	m->npages = len ? (end - first) / page : 0;
+	m->pid = -1;
+	m->node = node;
+	m->prio = prio;
+	m->flags = flags ? flags : MPOL_MF_MOVE;
+	m->cb = cb;
+	m->arg = arg;
+	return submit(m);
+}
+
+/* Like nusa_migrate_pages(pid, from, to), in the background. This is
+   a single kernel call, so cancel has no effect once it started. */
+struct nusa_migration *nusa_migrate_pages_async(int pid, struct bitmask *from,
+						struct bitmask *to, int prio,
+						nusa_migration_cb cb,
+						void *arg)
+{
+	struct nusa_migration *m;
+
+	if (pid < 0 || !from || !to) {
+		errno = EINVAL;
+		return NULL;
+	}
+	m = calloc(1, sizeof(struct nusa_migration));
+	if (!m)
+		return NULL;
+	m->from = nusa_allocate_nodemask();
+	m->to = nusa_allocate_nodemask();
+	if (!m->from || !m->to) {
+		free_masks(m);
+		free(m);
+		errno = ENOMEM;
+		return NULL;
+	}
+	copy_bitmask_to_bitmask(from, m->from);
+	copy_bitmask_to_bitmask(to, m->to);
+	m->pid = pid;
+	m->prio = prio;
+	m->cb = cb;
+	m->arg = arg;
+	return submit(m);
+}
+
+/* 1 when the migration is finished, 0 while it is still running */
+int nusa_migration_poll(struct nusa_migration *m)
+{
+	int done;
+
+	pthread_mutex_lock(&mig_lock);
+	done = m->done;
+	pthread_mutex_unlock(&mig_lock);
+	return done;
+}
+
+static int result(struct nusa_migration *m, struct nusa_migration_stats *st)
+{
+	if (st) {
+		st->pages = m->pid < 0 ? m->npages : 0;
+		st->moved = m->moved;
+		st->failed = m->failed;
+		st->cancelled = m->cancel;
+	}
+	if (m->error) {
+		errno = m->error;
+		return -1;
+	}
+	return m->failed || m->cancel ? 1 : 0;
+}
+
+/* Wait until the migration is finished. Returns 0 when all pages were
+   moved, 1 when some were not or it was cancelled, -1 with errno on an
+   error. st, when not NULL, gets the page counts. */
+int nusa_migration_wait(struct nusa_migration *m,
+			struct nusa_migration_stats *st)
+{
+	int ret;
+
+	pthread_mutex_lock(&mig_lock);
+	while (!m->done)
+		pthread_cond_wait(&m->finished, &mig_lock);
+	ret = result(m, st);
+	pthread_mutex_unlock(&mig_lock);
+	return ret;
+}
+
+/* Return an eventfd that becomes readable when the migration is done,
+   for use with poll or epoll. It belongs to the handle. */
+int nusa_migration_eventfd(struct nusa_migration *m)
+{
+	int fd;
+
+	pthread_mutex_lock(&mig_lock);
+	if (m->efd < 0) {
+		m->efd = eventfd(m->done, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (m->efd < 0) {
+			fd = -1;
+			goto out;
+		}
+	}
+	fd = m->efd;
+out:
+	pthread_mutex_unlock(&mig_lock);
+	return fd;
+}
+
+/* Stop handing out batches. Batches already running finish. Returns
+   0 if the migration was stopped early, -1 with errno EALREADY when
+   there was nothing left to cancel. */
+int nusa_migration_cancel(struct nusa_migration *m)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&mig_lock);
+	if (!m->queued) {
+		ret = -1;
+		errno = EALREADY;
+	} else {
+		dequeue(m);
+		m->cancel = 1;
+		if (m->running == 0)
+			finish(m);
+	}
+	pthread_mutex_unlock(&mig_lock);
+	return ret;
+}
+
+/* Move a queued migration ahead of or behind others */
+void nusa_migration_set_priority(struct nusa_migration *m, int prio)
+{
+	pthread_mutex_lock(&mig_lock);
+	m->prio = prio;
+	if (m->queued) {
+		dequeue(m);
+		enqueue(m);
+	}
+	pthread_mutex_unlock(&mig_lock);
+}
+
+/* Cancel what is left, wait for the rest and free the handle */
+void nusa_migration_free(struct nusa_migration *m)
+{
+	struct nusa_migration **p;
+
+	if (!m)
+		return;
+	nusa_migration_cancel(m);
+	nusa_migration_wait(m, NULL);
+	pthread_mutex_lock(&mig_lock);
+	for (p = &mig_live; *p && *p != m; p = &(*p)->next_live)
+		;
+	if (*p)
+		*p = m->next_live;
+	pthread_mutex_unlock(&mig_lock);
+	if (m->efd >= 0)
+		close(m->efd);
+	pthread_cond_destroy(&m->finished);
+	free_masks(m);
+	free(m);
+}
@@ -0,0 +1,266 @@
+/* Extended libnusa interfaces.
+
+   libnusa is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; version
+   2.1.
+
+   libnusa is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should find a copy of v2.1 of the GNU Lesser General Public License
+   somewhere on your Linux system; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA */
+
+#ifndef _NUSAEXT_H
+#define _NUSAEXT_H 1
+
+#include <nusa.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Flags for nusa_prefault_memory */
+#define NUSA_PREFAULT_WRITE	(1 << 0)	/* fault pages in writable */
+
+/* Fault in all pages of a range according to its memory policy, using
+   threads running on the nodes the policy places the pages on. Each
+   mapping and policy range in it is planned with its own policy.
+   pagesize is the page size of the mapping, 0 for the base page size.
+   Fails with ENOMEM when part of the range is not mapped. Without
+   NUSA_PREFAULT_WRITE private anonymous memory is mapped to the shared
+   zero page and nothing is placed; pass it for such memory. */
+int nusa_prefault_memory(void *start, size_t size, size_t pagesize, int flags);
+
+/* Return the k-th nearest node to node by distance (k == 0 is the node
+   itself), or -1 if there is none. */
+int nusa_nearest_node(int node, int k);
+
+/* Return the hop group of node b as seen from node a: 0 for a itself,
+   1 for the nearest distance class and so on. -1 for unknown nodes. */
+int nusa_node_hops(int a, int b);
+
+/* Write a binary snapshot of the topology (nodes, cpu to node map,
+   distances) to path, NULL for the default location
+   (/run/nusa/topology or $NUSA_TOPOLOGY_SNAPSHOT). When a snapshot
+   matching the running system exists, libnusa reads it instead of
+   scanning sysfs. */
+int nusa_write_topology_snapshot(const char *path);
+
+/* Node of the cpu the calling thread runs on, -1 on error. Reads the
+   cpu from the rseq area when available, so it is cheap enough to be
+   called per allocation. */
+int nusa_current_node(void);
+
+/* Arenas for small node local objects. Memory is reserved in large
+   chunks that are bound once, objects come from per thread caches and
+   can be freed by any thread. Everything is released at once by
+   nusa_arena_destroy. Objects are 16 byte aligned. */
+#define NUSA_ARENA_MAX_SIZE	4096	/* largest object an arena serves */
+
+struct nusa_arena;
+
+struct nusa_arena *nusa_arena_create(int policy, struct bitmask *nodes,
+				     size_t chunk_size);
+struct nusa_arena *nusa_arena_create_onnode(int node);
+void *nusa_arena_alloc(struct nusa_arena *arena, size_t size);
+void nusa_arena_free(struct nusa_arena *arena, void *obj);
+void nusa_arena_destroy(struct nusa_arena *arena);
+
+/* Pools of fixed size objects kept on their node. Free objects are
+   held on lock free per cpu lists. Objects freed on another node are
+   returned to their node in batches; nusa_pool_flush returns the
+   batches of the calling thread early. */
+struct nusa_pool;
+
+struct nusa_pool_stats {
+	unsigned long slabs;		/* 2MB slabs on the node */
+	unsigned long objects;		/* objects in those slabs */
+	unsigned long in_use;		/* objects allocated and not freed */
+	unsigned long remote_frees;	/* frees from cpus of other nodes */
+};
+
+struct nusa_pool *nusa_pool_create(size_t size);
+void *nusa_pool_alloc(struct nusa_pool *pool);
+void *nusa_pool_alloc_onnode(struct nusa_pool *pool, int node);
+void nusa_pool_free(struct nusa_pool *pool, void *obj);
+void nusa_pool_flush(struct nusa_pool *pool);
+int nusa_pool_stats(struct nusa_pool *pool, int node,
+		    struct nusa_pool_stats *stats);
+void nusa_pool_destroy(struct nusa_pool *pool);
+
+/* Thread pool with workers pinned to the cpus of nodes. Idle workers
+   steal from workers sharing their cache first, then from their node,
+   then from the nearest nodes. nusa_threadpool_wait and
+   nusa_threadpool_for_pages must not be called from a task. */
+struct nusa_threadpool;
+
+struct nusa_threadpool *nusa_threadpool_create(struct bitmask *nodes,
+					       int per_node);
+int nusa_threadpool_submit(struct nusa_threadpool *pool, int node,
+			   void (*fn)(void *arg), void *arg);
+void nusa_threadpool_wait(struct nusa_threadpool *pool);
+void nusa_threadpool_destroy(struct nusa_threadpool *pool);
+
+/* Run fn over [start, start + len) in chunks, each on the node its
+   memory is on, and wait for all chunks. chunk 0 is 2MB. Returns 1
+   instead of 0 when the nodes of the memory could not be read and the
+   chunks ran on the current node instead, -1 with errno on error. */
+int nusa_threadpool_for_pages(struct nusa_threadpool *pool, void *start,
+			      size_t len, size_t chunk,
+			      void (*fn)(void *start, size_t len, void *arg),
+			      void *arg);
+
+/* Read mostly regions with a copy on every node. Readers get the copy
+   on their own node. An update is made in a private copy from
+   nusa_replica_write_begin and goes to all nodes at once with
+   nusa_replica_publish. */
+struct nusa_replica;
+
+struct nusa_replica *nusa_replica_create(size_t size, struct bitmask *nodes);
+const void *nusa_replica_read_lock(struct nusa_replica *replica);
+void nusa_replica_read_unlock(struct nusa_replica *replica, const void *data);
+void *nusa_replica_write_begin(struct nusa_replica *replica);
+void nusa_replica_publish(struct nusa_replica *replica);
+void nusa_replica_destroy(struct nusa_replica *replica);
+
+/* Cohort lock: hands the lock to waiters on the holder's node first,
+   a bounded number of times, before other nodes get a turn. */
+struct nusa_cohort_lock;
+
+struct nusa_cohort_lock *nusa_cohort_lock_create(void);
+void nusa_cohort_lock(struct nusa_cohort_lock *lock);
+void nusa_cohort_unlock(struct nusa_cohort_lock *lock);
+void nusa_cohort_lock_destroy(struct nusa_cohort_lock *lock);
+
+/* Statistic counters sharded per cpu, with the shards of a node on
+   that node. nusa_counter_read sums a node, or all nodes for -1. */
+struct nusa_counter;
+
+struct nusa_counter *nusa_counter_create(void);
+void nusa_counter_add(struct nusa_counter *counter, long val);
+long nusa_counter_read(struct nusa_counter *counter, int node);
+void nusa_counter_destroy(struct nusa_counter *counter);
+
+/* Bulk copy and fill split over threads on the nodes the destination
+   (or else the source) is on, with non temporal stores for large sizes.
+   Small sizes run in the caller. st, when not NULL, gets the bandwidth
+   achieved. Return 0, or -1 with errno set. */
+struct nusa_bulk_stats {
+	size_t bytes;
+	double seconds;
+	double bytes_per_sec;
+	unsigned long chunks;		/* work units */
+	int nodes;			/* nodes the work ran on */
+};
+
+int nusa_bulk_copy(void *dst, const void *src, size_t len,
+		   struct nusa_bulk_stats *st);
+int nusa_bulk_fill(void *dst, int c, size_t len, struct nusa_bulk_stats *st);
+
+/* Asynchronous page migration. Background threads move the pages in
+   batches, highest priority request first; 0 is normal priority. The
+   handle reports completion by nusa_migration_poll, nusa_migration_wait,
+   the callback or an eventfd, and must be released with
+   nusa_migration_free, which cancels what is left. */
+struct nusa_migration;
+
+struct nusa_migration_stats {
+	unsigned long pages;		/* in the range */
+	unsigned long moved;		/* on the target node or not present */
+	unsigned long failed;		/* could not be moved */
+	int cancelled;
+};
+
+typedef void (*nusa_migration_cb)(struct nusa_migration *migration,
+				  void *arg);
+
+struct nusa_migration *nusa_migrate_range_async(void *start, size_t len,
+						int node, int prio, int flags,
+						nusa_migration_cb cb,
+						void *arg);
+struct nusa_migration *nusa_migrate_pages_async(int pid, struct bitmask *from,
+						struct bitmask *to, int prio,
+						nusa_migration_cb cb,
+						void *arg);
+int nusa_migration_poll(struct nusa_migration *migration);
+int nusa_migration_wait(struct nusa_migration *migration,
+			struct nusa_migration_stats *st);
+int nusa_migration_eventfd(struct nusa_migration *migration);
+int nusa_migration_cancel(struct nusa_migration *migration);
+void nusa_migration_set_priority(struct nusa_migration *migration, int prio);
+void nusa_migration_free(struct nusa_migration *migration);
+
+/* Flags for nusa_stripe_memory */
+#define NUSA_STRIPE_STRICT	(1 << 0)	/* bind, no fallback nodes */
+#define NUSA_STRIPE_MOVE	(1 << 1)	/* move pages already present */
+
+/* Interleave a range over nodes in chunks of chunk bytes instead of
+   pages, so each chunk can be a huge page on one node. 0 is 2MB.
+   Every chunk becomes its own mapping; fails with ENOMEM when size /
+   chunk is more than vm.max_map_count leaves room for. */
+int nusa_stripe_memory(void *mem, size_t size, struct bitmask *nodes,
+		       size_t chunk, int flags);
+void *nusa_alloc_striped(size_t size, struct bitmask *nodes, size_t chunk,
+			 int flags);
+
+#ifndef MPOL_LOCAL
+#define MPOL_LOCAL 4
+#endif
+#ifndef MPOL_PREFERRED_MANY
+#define MPOL_PREFERRED_MANY 5
+#endif
+
+/* Prefer a set of nodes and fall back to others only when all of them
+   are full. */
+int nusa_has_preferred_many(void);
+void nusa_set_preferred_many(struct bitmask *bmp);
+struct bitmask *nusa_preferred_many(void);
+
+#ifndef MPOL_WEIGHTED_INTERLEAVE
+#define MPOL_WEIGHTED_INTERLEAVE 6
+#endif
+
+/* Weighted interleave: each node gets its weight in pages in a row.
+   The weights are system wide and setting them needs root. */
+int nusa_interleave_weight(int node);
+int nusa_set_interleave_weight(int node, int weight);
+int nusa_interleave_weights_from_bandwidth(const double *bw, int *weights,
+					   int n);
+int nusa_weighted_interleave_memory(void *mem, size_t size,
+				    struct bitmask *nodes);
+int nusa_set_weighted_interleave_mask(struct bitmask *nodes);
+
+/* Word at a time bitmask operations. The masks may differ in size: bits
+   past the end of a source read as clear, bits past the end of dst are
+   dropped. dst may alias a source. They return dst. */
+struct bitmask *nusa_bitmask_and(struct bitmask *dst, const struct bitmask *a,
+				 const struct bitmask *b);
+struct bitmask *nusa_bitmask_or(struct bitmask *dst, const struct bitmask *a,
+				const struct bitmask *b);
+struct bitmask *nusa_bitmask_andnot(struct bitmask *dst,
+				    const struct bitmask *a,
+				    const struct bitmask *b);
+
+/* Return the first set bit >= bit (next) or the last set bit <= bit
+   (prev), -1 if there is none. Iterate with
+   for (i = nusa_bitmask_next(m, 0); i >= 0; i = nusa_bitmask_next(m, i + 1)) */
+int nusa_bitmask_next(const struct bitmask *bmp, int bit);
+int nusa_bitmask_prev(const struct bitmask *bmp, int bit);
+
+/* Set bits lo to hi inclusive. NULL with errno EINVAL for a bad range. */
+struct bitmask *nusa_bitmask_setrange(struct bitmask *bmp,
+				      unsigned int lo, unsigned int hi);
+
+/* Format as a compressed range list ("0-3,8"). Returns the untruncated
+   length like snprintf. */
+int nusa_bitmask_format_list(const struct bitmask *bmp, char *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
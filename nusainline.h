@@ -0,0 +1,87 @@
+/* Inline fast paths for libnusa.
+
+   libnusa is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; version
+   2.1.
+
+   libnusa is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should find a copy of v2.1 of the GNU Lesser General Public License
+   somewhere on your Linux system; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA */
+
+/* This header is optional. It provides inline versions of the most
+   frequently used bit and topology queries for hot paths, where the
+   call through the PLT costs more than the operation itself. The
+   out of line functions in nusa.h are unchanged and behave the same. */
+
+#ifndef _NUSAINLINE_H
+#define _NUSAINLINE_H 1
+
+#include <errno.h>
+#include <nusa.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NUSA_BITS_PER_LONG	(8 * sizeof(unsigned long))
+
+/* Same as nusa_bitmask_isbitset: 0 for bits beyond the mask */
+static inline int nusa_bitmask_test(const struct bitmask *bmp, unsigned int n)
+{
+	if (n >= bmp->size)
+		return 0;
+	return (bmp->maskp[n / NUSA_BITS_PER_LONG] >>
+		(n % NUSA_BITS_PER_LONG)) & 1;
+}
+
+/* Same as nusa_bitmask_setbit/clearbit: bits beyond the mask are ignored */
+static inline void nusa_bitmask_set(struct bitmask *bmp, unsigned int n)
+{
+	if (n < bmp->size)
+		bmp->maskp[n / NUSA_BITS_PER_LONG] |=
+			1UL << (n % NUSA_BITS_PER_LONG);
+}
+
+static inline void nusa_bitmask_clear(struct bitmask *bmp, unsigned int n)
+{
+	if (n < bmp->size)
+		bmp->maskp[n / NUSA_BITS_PER_LONG] &=
+			~(1UL << (n % NUSA_BITS_PER_LONG));
+}
+
+/* cpu to node table, indexed by cpu number with -1 for cpus without
+   a node. NULL until it has been built, which nusa_cpu_node_map does
+   on first use. */
+extern const int *nusa_cpu_to_node;
+extern int nusa_cpu_to_node_size;
+
+/* Build the table if needed and return it, the number of entries in
+   *ncpus. NULL when the topology cannot be read. */
+const int *nusa_cpu_node_map(int *ncpus);
+
+/* Like nusa_node_of_cpu, without a call once the table is built */
+static inline int nusa_node_of_cpu_fast(int cpu)
+{
+	const int *map = __atomic_load_n(&nusa_cpu_to_node, __ATOMIC_ACQUIRE);
+	int n = nusa_cpu_to_node_size;
+
+	if (__builtin_expect(map == NULL, 0))
+		map = nusa_cpu_node_map(&n);
+	if (!map || (unsigned)cpu >= (unsigned)n || map[cpu] < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	return map[cpu];
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,94 @@
+/* Preferred many policy.
+
+   libnusa is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; version
+   2.1.
+
+   libnusa is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should find a copy of v2.1 of the GNU Lesser General Public License
+   somewhere on your Linux system; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+   MPOL_PREFERRED_MANY (Linux 5.15) allocates from the nearest node of a
+   set and only falls back to other nodes when the whole set is full.
+   It sits between MPOL_PREFERRED, which names a single node, and
+   MPOL_BIND, which never falls back. */
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <pthread.h>
+#include "nusa.h"
+#include "nusaif.h"
+#include "nusaint.h"
+#include "nusaext.h"
+
+static pthread_once_t preferred_many_once = PTHREAD_ONCE_INIT;
+static int preferred_many;
+
+/* Try the policy on the calling thread and put the old one back */
+static void probe_preferred_many(void)
+{
+	struct bitmask *old = nusa_allocate_nodemask();
+	struct bitmask *one = nusa_allocate_nodemask();
+	int mode;
+
+	if (!old || !one)
+		goto out;
+	if (get_prampolicy(&mode, old->maskp, old->size + 1, NULL, 0) < 0)
+		goto out;
+	nusa_bitmask_setbit(one, nusa_bitmask_next(nusa_all_nodes_ptr, 0));
+	if (set_prampolicy(MPOL_PREFERRED_MANY, one->maskp,
+			   one->size + 1) == 0) {
+		preferred_many = 1;
+		set_prampolicy(mode, old->maskp, old->size + 1);
+	}
+out:
+	if (old)
+		nusa_bitmask_free(old);
+	if (one)
+		nusa_bitmask_free(one);
+}
+
+/* 1 when the kernel has MPOL_PREFERRED_MANY */
+int nusa_has_preferred_many(void)
+{
+	pthread_once(&preferred_many_once, probe_preferred_many);
+	return preferred_many;
+}
+
+/* Prefer the nodes in bmp for the calling thread. An empty mask is
+   local allocation. */
+void nusa_set_preferred_many(struct bitmask *bmp)
+{
+	int ret;
+
+	if (nusa_bitmask_weight(bmp) == 0)
+		ret = set_prampolicy(MPOL_LOCAL, NULL, 0);
+	else
+		ret = set_prampolicy(MPOL_PREFERRED_MANY, bmp->maskp,
+				     bmp->size + 1);
+	if (ret < 0)
+		nusa_error("set_prampolicy");
+}
+
+/* Return the preferred nodes of the calling thread, empty when its
+   policy is not a preferred one. Free with nusa_bitmask_free. */
+struct bitmask *nusa_preferred_many(void)
+{
+	struct bitmask *bmp = nusa_allocate_nodemask();
+	int mode;
+
+	if (!bmp)
+		return NULL;
+	if (get_prampolicy(&mode, bmp->maskp, bmp->size + 1, NULL, 0) < 0) {
+		nusa_error("get_prampolicy");
+		nusa_bitmask_clearall(bmp);
+	} else if (mode != MPOL_PREFERRED && mode != MPOL_PREFERRED_MANY) {
+		nusa_bitmask_clearall(bmp);
+	}
+	return bmp;
+}
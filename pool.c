@@ -0,0 +1,489 @@
+/* Per node pools of fixed size objects.
+
+   libnusa is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; version
+   2.1.
+
+   libnusa is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should find a copy of v2.1 of the GNU Lesser General Public License
+   somewhere on your Linux system; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+   Objects live in 2MB slabs, aligned to their size and bound to one node
+   like nusa_alloc_onnode memory. Free objects sit on lock free stacks:
+   one per cpu for objects freed on the cpu's own node, and one per node
+   for new slabs and objects coming back from other nodes. Objects are
+   named by 32bit ids, so a stack head is an id plus a generation count
+   in one 64bit word and a plain compare and swap avoids ABA.
+
+   A free on a remote node is queued in the freeing thread and handed
+   back to the owning node in batches, so the owner's stack line moves
+   once per batch instead of once per object. */
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "nusa.h"
+#include "nusaif.h"
+#include "nusaint.h"
+#include "nusaext.h"
+#include "topology.h"
+
+#define POOL_SLAB	(2UL << 20)	/* slab size and alignment */
+#define POOL_HEADER	64		/* slab header, objects start after it */
+#define POOL_MAX_SLABS	16384		/* ids must fit in 32bit */
+#define POOL_BATCH	64		/* remote frees per hand back */
+#define CACHELINE	64
+
+struct pool_slab {
+	struct nusa_pool *pool;
+	unsigned slab;			/* index in pool->slabs */
+	int node;
+};
+
+/* A lock free stack of free objects. head is generation << 32 | id,
+   id 0 is the empty stack. */
+struct pool_list {
+	uint64_t head;
+} __attribute__((aligned(CACHELINE)));
+
+/* Counters of one cpu, per node. Only the cpu's threads update them,
+   the atomics cover threads that migrate in between. */
+struct pool_count {
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long remote;
+	unsigned long pad;
+};
+
+struct pool_batch {
+	uint32_t first, last;
+	unsigned count;
+};
+
+/* Remote frees queued by one thread */
+struct pool_tcache {
+	struct nusa_pool *pool;
+	struct pool_tcache *next, **pprev;
+	struct pool_batch batch[];	/* per node */
+};
+
+struct nusa_pool {
+	size_t slot;			/* object size with padding */
+	unsigned per_slab;		/* objects per slab */
+	int nnodes;			/* max node + 1 */
+	int ncpus;
+	const int *cpu_node;
+	int *home;			/* node memory is taken from */
+	struct pool_list *cpu;		/* per cpu free objects */
+	struct pool_list *node;		/* per node free objects */
+	struct pool_count *count;	/* per cpu, count_stride per cpu */
+	int count_stride;
+	unsigned long *node_slabs;
+	char **slabs;
+	unsigned nslabs;
+	pthread_mutex_t lock;		/* protects slab creation */
+	pthread_key_t key;
+	struct pool_tcache *tcaches;
+};
+
+static inline char *id_to_obj(struct nusa_pool *p, uint32_t id)
+{
+	id--;
+	return p->slabs[id / p->per_slab] + POOL_HEADER +
+		(id % p->per_slab) * p->slot;
+}
+
+static inline struct pool_slab *obj_slab(void *obj)
+{
+	return (struct pool_slab *)((uintptr_t)obj & ~(POOL_SLAB - 1));
+}
+
+static inline uint32_t obj_to_id(struct nusa_pool *p, void *obj)
+{
+	struct pool_slab *s = obj_slab(obj);
+
+	return s->slab * p->per_slab +
+		((char *)obj - (char *)s - POOL_HEADER) / p->slot + 1;
+}
+
+/* The link of a free object is in its first word. It can be read while
+   another thread reuses the object: the generation count makes the
+   compare and swap fail then. */
+static inline uint32_t get_next(struct nusa_pool *p, uint32_t id)
+{
+	return __atomic_load_n((uint32_t *)id_to_obj(p, id), __ATOMIC_RELAXED);
+}
+
+static inline void set_next(struct nusa_pool *p, uint32_t id, uint32_t next)
+{
+	__atomic_store_n((uint32_t *)id_to_obj(p, id), next, __ATOMIC_RELAXED);
+}
+
+static void push_chain(struct nusa_pool *p, struct pool_list *l,
+		       uint32_t first, uint32_t last)
+{
+	uint64_t old = __atomic_load_n(&l->head, __ATOMIC_RELAXED), new;
+
+	do {
+		set_next(p, last, (uint32_t)old);
+		new = ((old >> 32) + 1) << 32 | first;
+	} while (!__atomic_compare_exchange_n(&l->head, &old, new, 1,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+}
+
+static uint32_t pop(struct nusa_pool *p, struct pool_list *l)
+{
+	uint64_t old = __atomic_load_n(&l->head, __ATOMIC_ACQUIRE), new;
+	uint32_t id;
+
+	do {
+		id = (uint32_t)old;
+		if (!id)
+			return 0;
+		new = ((old >> 32) + 1) << 32 | get_next(p, id);
+	} while (!__atomic_compare_exchange_n(&l->head, &old, new, 1,
+					      __ATOMIC_ACQUIRE,
+					      __ATOMIC_ACQUIRE));
+	return id;
+}
+
+/* Take the whole stack */
+static uint32_t pop_all(struct pool_list *l)
+{
+	uint64_t old = __atomic_load_n(&l->head, __ATOMIC_ACQUIRE), new;
+
+	do {
+		if (!(uint32_t)old)
+			return 0;
+		new = ((old >> 32) + 1) << 32;
+	} while (!__atomic_compare_exchange_n(&l->head, &old, new, 1,
+					      __ATOMIC_ACQUIRE,
+					      __ATOMIC_ACQUIRE));
+	return (uint32_t)old;
+}
+
+static inline struct pool_count *counter(struct nusa_pool *p, int cpu,
+					 int node)
+{
+	return &p->count[cpu * p->count_stride + node];
+}
+
+/* Add a slab on node and put its objects on the node stack */
+static int grow(struct nusa_pool *p, int node)
+{
+	struct pool_slab *s;
+	char *m, *start;
+	uint32_t first, i;
+	unsigned n;
+
+	pthread_mutex_lock(&p->lock);
+	n = p->nslabs;
+	if (n >= POOL_MAX_SLABS) {
+		pthread_mutex_unlock(&p->lock);
+		errno = ENOMEM;
+		return -1;
+	}
+	m = mmap(NULL, 2 * POOL_SLAB, PROT_READ|PROT_WRITE,
+		 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (m == MAP_FAILED) {
+		pthread_mutex_unlock(&p->lock);
+		return -1;
+	}
+	start = (char *)(((uintptr_t)m + POOL_SLAB - 1) & ~(POOL_SLAB - 1));
+	if (start > m)
+		munmap(m, start - m);
+	munmap(start + POOL_SLAB, m + POOL_SLAB - start);
+	nusa_tonode_memory(start, POOL_SLAB, node);
+
+	s = (struct pool_slab *)start;
+	s->pool = p;
+	s->slab = n;
+	s->node = node;
+	p->slabs[n] = start;
+	p->node_slabs[node]++;
+	__atomic_store_n(&p->nslabs, n + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&p->lock);
+
+	first = n * p->per_slab + 1;
+	for (i = 0; i < p->per_slab - 1; i++)
+		set_next(p, first + i, first + i + 1);
+	push_chain(p, &p->node[node], first, first + p->per_slab - 1);
+	return 0;
+}
+
+static void flush_batch(struct nusa_pool *p, struct pool_batch *b, int node)
+{
+	if (!b->count)
+		return;
+	push_chain(p, &p->node[node], b->first, b->last);
+	b->first = b->last = 0;
+	b->count = 0;
+}
+
+static void tcache_destroy(void *arg)
+{
+	struct pool_tcache *tc = arg;
+	struct nusa_pool *p = tc->pool;
+	int node;
+
+	for (node = 0; node < p->nnodes; node++)
+		flush_batch(p, &tc->batch[node], node);
+	pthread_mutex_lock(&p->lock);
+	*tc->pprev = tc->next;
+	if (tc->next)
+		tc->next->pprev = tc->pprev;
+	pthread_mutex_unlock(&p->lock);
+	free(tc);
+}
+
+static struct pool_tcache *get_tcache(struct nusa_pool *p)
+{
+	struct pool_tcache *tc = pthread_getspecific(p->key);
+
+	if (__builtin_expect(tc != NULL, 1))
+		return tc;
+	tc = calloc(1, sizeof(struct pool_tcache) +
+		       p->nnodes * sizeof(struct pool_batch));
+	if (!tc)
+		return NULL;
+	tc->pool = p;
+	pthread_mutex_lock(&p->lock);
+	tc->next = p->tcaches;
+	if (tc->next)
+		tc->next->pprev = &tc->next;
+	tc->pprev = &p->tcaches;
+	p->tcaches = tc;
+	pthread_mutex_unlock(&p->lock);
+	pthread_setspecific(p->key, tc);
+	return tc;
+}
+
+/* Create a pool of objects of size bytes. Objects of 64 bytes or more
+   are cache line aligned, smaller ones 16 byte aligned. */
+struct nusa_pool *nusa_pool_create(size_t size)
+{
+	struct nusa_pool *p;
+	int node;
+
+	if (size == 0 || size > (POOL_SLAB - POOL_HEADER) / 8) {
+		errno = EINVAL;
+		return NULL;
+	}
+	p = calloc(1, sizeof(struct nusa_pool));
+	if (!p)
+		return NULL;
+	p->slot = size < CACHELINE ? (size + 15) & ~15UL :
+				     (size + CACHELINE - 1) & ~(CACHELINE - 1UL);
+	p->per_slab = (POOL_SLAB - POOL_HEADER) / p->slot;
+	p->nnodes = nusa_max_node() + 1;
+	p->ncpus = topo_num_cpus();
+	/* keep the counters of different cpus in different lines */
+	p->count_stride = (p->nnodes + 1) & ~1;
+	p->cpu_node = topo_cpu_node_table();
+	if (!p->cpu_node || pthread_key_create(&p->key, tcache_destroy)) {
+		free(p);
+		errno = EINVAL;
+		return NULL;
+	}
+	pthread_mutex_init(&p->lock, NULL);
+	p->home = calloc(p->nnodes, sizeof(int));
+	p->node_slabs = calloc(p->nnodes, sizeof(unsigned long));
+	p->slabs = calloc(POOL_MAX_SLABS, sizeof(char *));
+	if (posix_memalign((void **)&p->cpu, CACHELINE,
+			   p->ncpus * sizeof(struct pool_list)))
+		p->cpu = NULL;
+	if (posix_memalign((void **)&p->node, CACHELINE,
+			   p->nnodes * sizeof(struct pool_list)))
+		p->node = NULL;
+	if (posix_memalign((void **)&p->count, CACHELINE,
+			   p->ncpus * p->count_stride * sizeof(struct pool_count)))
+		p->count = NULL;
+	if (!p->home || !p->node_slabs || !p->slabs || !p->cpu ||
+	    !p->node || !p->count) {
+		nusa_pool_destroy(p);
+		errno = ENOMEM;
+		return NULL;
+	}
+	memset(p->cpu, 0, p->ncpus * sizeof(struct pool_list));
+	memset(p->node, 0, p->nnodes * sizeof(struct pool_list));
+	memset(p->count, 0,
+	       p->ncpus * p->count_stride * sizeof(struct pool_count));
+
+	/* memoryless nodes take objects from the nearest node with memory */
+	for (node = 0; node < p->nnodes; node++) {
+		int k, near = node;
+
+		for (k = 0; near >= 0 &&
+			    !nusa_bitmask_isbitset(nusa_all_nodes_ptr, near); k++)
+			near = nusa_nearest_node(node, k);
+		if (near < 0)
+			near = nusa_bitmask_next(nusa_all_nodes_ptr, 0);
+		p->home[node] = near >= 0 ? near : 0;
+	}
+	return p;
+}
+
+/* Allocate an object on node */
+void *nusa_pool_alloc_onnode(struct nusa_pool *p, int node)
+{
+	int cpu = current_cpu();
+	uint32_t id, rest;
+	int i;
+
+	if (node < 0 || node >= p->nnodes) {
+		errno = EINVAL;
+		return NULL;
+	}
+	node = p->home[node];
+	if ((unsigned)cpu >= (unsigned)p->ncpus)
+		cpu = 0;
+	for (;;) {
+		if (p->cpu_node[cpu] == node) {
+			id = pop(p, &p->cpu[cpu]);
+			if (id)
+				break;
+			/* refill the cpu stack from the node stack */
+			id = pop_all(&p->node[node]);
+			if (id) {
+				rest = get_next(p, id);
+				if (rest) {
+					uint32_t last = rest;
+
+					while (get_next(p, last))
+						last = get_next(p, last);
+					push_chain(p, &p->cpu[cpu], rest, last);
+				}
+				break;
+			}
+		} else {
+			id = pop(p, &p->node[node]);
+			if (id)
+				break;
+		}
+		/* take from other cpus of the node before growing */
+		for (i = 0, id = 0; i < p->ncpus && !id; i++)
+			if (i != cpu && p->cpu_node[i] == node)
+				id = pop(p, &p->cpu[i]);
+		if (id)
+			break;
+		if (grow(p, node) < 0)
+			return NULL;
+	}
+	__atomic_fetch_add(&counter(p, cpu, node)->allocs, 1, __ATOMIC_RELAXED);
+	return id_to_obj(p, id);
+}
+
+/* Allocate an object on the node of the current cpu */
+void *nusa_pool_alloc(struct nusa_pool *p)
+{
+	int cpu = current_cpu();
+	int node = (unsigned)cpu < (unsigned)p->ncpus ? p->cpu_node[cpu] : -1;
+
+	return nusa_pool_alloc_onnode(p, node >= 0 ? node : 0);
+}
+
+void nusa_pool_free(struct nusa_pool *p, void *obj)
+{
+	int cpu = current_cpu();
+	int node = obj_slab(obj)->node;
+	uint32_t id = obj_to_id(p, obj);
+	struct pool_tcache *tc;
+	struct pool_batch *b;
+
+	if ((unsigned)cpu >= (unsigned)p->ncpus)
+		cpu = 0;
+	__atomic_fetch_add(&counter(p, cpu, node)->frees, 1, __ATOMIC_RELAXED);
+	if (p->cpu_node[cpu] == node) {
+		push_chain(p, &p->cpu[cpu], id, id);
+		return;
+	}
+
+	__atomic_fetch_add(&counter(p, cpu, node)->remote, 1, __ATOMIC_RELAXED);
+	tc = get_tcache(p);
+	if (!tc) {
+		push_chain(p, &p->node[node], id, id);
+		return;
+	}
+	b = &tc->batch[node];
+	set_next(p, id, b->first);
+	b->first = id;
+	if (!b->count++)
+		b->last = id;
+	if (b->count >= POOL_BATCH)
+		flush_batch(p, b, node);
+}
+
+/* Hand back the remote frees queued by the calling thread. Threads
+   do this when they exit. */
+void nusa_pool_flush(struct nusa_pool *p)
+{
+	struct pool_tcache *tc = pthread_getspecific(p->key);
+	int node;
+
+	if (!tc)
+		return;
+	for (node = 0; node < p->nnodes; node++)
+		flush_batch(p, &tc->batch[node], node);
+}
+
+int nusa_pool_stats(struct nusa_pool *p, int node, struct nusa_pool_stats *st)
+{
+	long allocs = 0, frees = 0;
+	int cpu;
+
+	if (node < 0 || node >= p->nnodes) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(st, 0, sizeof(struct nusa_pool_stats));
+	for (cpu = 0; cpu < p->ncpus; cpu++) {
+		struct pool_count *c = counter(p, cpu, node);
+
+		allocs += __atomic_load_n(&c->allocs, __ATOMIC_RELAXED);
+		frees += __atomic_load_n(&c->frees, __ATOMIC_RELAXED);
+		st->remote_frees += __atomic_load_n(&c->remote,
+						    __ATOMIC_RELAXED);
+	}
+	pthread_mutex_lock(&p->lock);
+	st->slabs = p->node_slabs[node];
+	pthread_mutex_unlock(&p->lock);
+	st->objects = st->slabs * p->per_slab;
+	st->in_use = allocs > frees ? allocs - frees : 0;
+	return 0;
+}
+
+/* Free all slabs. No thread may use the pool any more. */
+void nusa_pool_destroy(struct nusa_pool *p)
+{
+	struct pool_tcache *tc, *next;
+	unsigned i;
+
+	if (!p)
+		return;
+	pthread_key_delete(p->key);
+	for (tc = p->tcaches; tc; tc = next) {
+		next = tc->next;
+		free(tc);
+	}
+	if (p->slabs)
+		for (i = 0; i < p->nslabs; i++)
+			munmap(p->slabs[i], POOL_SLAB);
+	free(p->slabs);
+	free(p->home);
+	free(p->node_slabs);
+	free(p->cpu);
+	free(p->node);
+	free(p->count);
+	pthread_mutex_destroy(&p->lock);
+	free(p);
+}
@@ -0,0 +1,372 @@
+/* Parallel, policy aware prefaulting of memory ranges.
+
+   libnusa is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; version
+   2.1.
+
+   libnusa is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should find a copy of v2.1 of the GNU Lesser General Public License
+   somewhere on your Linux system; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+   Each thread runs on the node its pages will be placed on, so the pages
+   are cleared locally and the faults of different nodes run in parallel.
+   Contiguous ranges are populated with MADV_POPULATE_READ/WRITE when the
+   kernel has it, interleaved pages are touched one by one. */
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "nusa.h"
+#include "nusaif.h"
+#include "nusaint.h"
+#include "nusaext.h"
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ	22
+#endif
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE	23
+#endif
+
+/* Don't start threads for less than this per thread. */
+#define PREFAULT_MIN_BYTES	(64UL << 20)
+
+/* Pages between policy samples of a VMA */
+#define PREFAULT_STEP		512
+
+struct prefault_work {
+	char *start;
+	size_t pagesize;
+	unsigned long first;	/* first page index handled */
+	unsigned long npages;	/* pages handled */
+	unsigned long stride;	/* distance between handled pages */
+	int node;		/* node to run on, -1 for anywhere */
+	int flags;
+	int err;
+	int started;
+	pthread_t thread;
+};
+
+static void touch_page(char *p, int flags)
+{
+	if (flags & NUSA_PREFAULT_WRITE)
+		__sync_fetch_and_add(p, 0);
+	else
+		(void)*(volatile char *)p;
+}
+
+static void *prefault_thread(void *arg)
+{
+	struct prefault_work *w = arg;
+	char *p = w->start + w->first * w->pagesize;
+	unsigned long i;
+
+	if (w->node >= 0)
+		nusa_run_on_node(w->node);
+
+	if (w->stride == 1) {
+		int advice = (w->flags & NUSA_PREFAULT_WRITE) ?
+				MADV_POPULATE_WRITE : MADV_POPULATE_READ;
+
+		if (madvise(p, w->npages * w->pagesize, advice) == 0)
+			return NULL;
+		if (errno != EINVAL) {
+			w->err = errno;
+			return NULL;
+		}
+		/* Older kernel: fall back to touching */
+	}
+	for (i = 0; i < w->npages; i++, p += w->stride * w->pagesize)
+		touch_page(p, w->flags);
+	return NULL;
+}
+
+static int node_threads(int node, unsigned long bytes)
+{
+	struct bitmask *cpus = nusa_allocate_cpumask();
+	unsigned long n = 1;
+
+	if (node >= 0 && nusa_node_to_cpus(node, cpus) == 0)
+		n = nusa_bitmask_weight(cpus);
+	else if (node < 0)
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	nusa_bitmask_free(cpus);
+	if (n > bytes / PREFAULT_MIN_BYTES)
+		n = bytes / PREFAULT_MIN_BYTES;
+	return n > 0 ? n : 1;
+}
+
+/* Split npages pages starting at page first (with stride) over the
+   threads of node. A small contiguous range following the previous
+   work item of the same node is added to it. */
+static int add_work(struct prefault_work **work, int *nwork, char *start,
+		    size_t pagesize, unsigned long first, unsigned long npages,
+		    unsigned long stride, int node, int flags)
+{
+	int i, n = node_threads(node, npages * pagesize);
+	unsigned long per = (npages + n - 1) / n;
+	struct prefault_work *nw;
+
+	if (n == 1 && stride == 1 && *nwork > 0) {
+		struct prefault_work *w = &(*work)[*nwork - 1];
+
+		if (w->node == node && w->stride == 1 &&
+		    w->first + w->npages == first &&
+		    (w->npages + npages) * pagesize <= PREFAULT_MIN_BYTES) {
+			w->npages += npages;
+			return 0;
+		}
+	}
+	nw = realloc(*work, (*nwork + n) * sizeof(struct prefault_work));
+	if (!nw)
+		return -1;
+	*work = nw;
+	for (i = 0; i < n && npages > 0; i++) {
+		struct prefault_work *w = &nw[(*nwork)++];
+		unsigned long cnt = npages < per ? npages : per;
+
+		w->start = start;
+		w->pagesize = pagesize;
+		w->first = first;
+		w->npages = cnt;
+		w->stride = stride;
+		w->node = node;
+		w->flags = flags;
+		w->err = 0;
+		first += cnt * stride;
+		npages -= cnt;
+	}
+	return 0;
+}
+
+struct prefault_plan {
+	struct prefault_work *work;
+	int nwork;
+	char *start;
+	size_t pagesize;
+	int flags;
+	struct bitmask *nodes;	/* policy of the current range */
+	struct bitmask *nodes2;	/* policy of the page looked at */
+};
+
+/* Plan npages pages from page first with one policy. ilx is the
+   interleave index of the first page: its page offset in the mapping,
+   as the kernel computes it. */
+static int plan_range(struct prefault_plan *pl, unsigned long first,
+		      unsigned long npages, unsigned long long ilx, int policy,
+		      struct bitmask *nodes)
+{
+	int i, slot, nnodes;
+
+	switch (policy) {
+	case MPOL_INTERLEAVE: {
+		int w = nusa_bitmask_weight(nodes), base;
+
+		if (w == 0)
+			break;
+		/* The first page goes to the node in slot base */
+		base = ilx % w;
+		for (i = 0, slot = 0; i < nodes->size; i++) {
+			unsigned long k, cnt;
+
+			if (!nusa_bitmask_isbitset(nodes, i))
+				continue;
+			k = (slot - base + w) % w;
+			slot++;
+			if (k >= npages)
+				continue;
+			cnt = (npages - k + w - 1) / w;
+			if (add_work(&pl->work, &pl->nwork, pl->start,
+				     pl->pagesize, first + k, cnt, w, i,
+				     pl->flags) < 0)
+				return -1;
+		}
+		return 0;
+	}
+	case MPOL_BIND:
+	case MPOL_PREFERRED_MANY:
+	case MPOL_PREFERRED:
+		nnodes = nusa_bitmask_weight(nodes);
+		if (nnodes > 0) {
+			/* Bind and preferred many allocate on the closest
+			   node of the mask, so give each node its share of
+			   the range. */
+			unsigned long per, done = 0;
+
+			if (policy == MPOL_PREFERRED)
+				nnodes = 1;
+			per = (npages + nnodes - 1) / nnodes;
+			for (i = 0; i < nodes->size && done < npages; i++) {
+				unsigned long cnt = npages - done;
+
+				if (!nusa_bitmask_isbitset(nodes, i))
+					continue;
+				if (cnt > per)
+					cnt = per;
+				if (add_work(&pl->work, &pl->nwork, pl->start,
+					     pl->pagesize, first + done, cnt, 1,
+					     i, pl->flags) < 0)
+					return -1;
+				done += cnt;
+			}
+			return 0;
+		}
+		/* preferred without node is local allocation */
+		break;
+	}
+	return add_work(&pl->work, &pl->nwork, pl->start, pl->pagesize, first,
+			npages, 1, -1, pl->flags);
+}
+
+static int policy_at(char *p, int *policy, struct bitmask *nodes)
+{
+	return get_prampolicy(policy, nodes->maskp, nodes->size, p,
+			      MPOL_F_ADDR);
+}
+
+/* Plan the part [ps,pe) of one VMA. The policy is sampled every
+   PREFAULT_STEP pages; when the samples differ the VMA is split in
+   ranges of one policy page by page. */
+static int plan_vma(struct prefault_plan *pl, char *ps, char *pe,
+		    unsigned long long ilx)
+{
+	size_t psz = pl->pagesize;
+	unsigned long step = (unsigned long)PREFAULT_STEP * psz;
+	int policy, pol2, uniform = 1;
+	char *p, *run;
+
+	if (policy_at(ps, &policy, pl->nodes) < 0)
+		return -1;
+	for (p = ps; (unsigned long)(pe - p) > step && uniform; ) {
+		p += step;
+		if (policy_at(p, &pol2, pl->nodes2) < 0)
+			return -1;
+		uniform = pol2 == policy &&
+			  nusa_bitmask_equal(pl->nodes, pl->nodes2);
+	}
+	if (uniform)
+		return plan_range(pl, (ps - pl->start) / psz, (pe - ps) / psz,
+				  ilx, policy, pl->nodes);
+
+	for (run = ps, p = ps + psz; ; p += psz) {
+		if (p < pe) {
+			if (policy_at(p, &pol2, pl->nodes2) < 0)
+				return -1;
+			if (pol2 == policy &&
+			    nusa_bitmask_equal(pl->nodes, pl->nodes2))
+				continue;
+		}
+		if (plan_range(pl, (run - pl->start) / psz, (p - run) / psz,
+			       ilx + (run - ps) / psz, policy, pl->nodes) < 0)
+			return -1;
+		if (p >= pe)
+			return 0;
+		run = p;
+		policy = pol2;
+		copy_bitmask_to_bitmask(pl->nodes2, pl->nodes);
+	}
+}
+
+/* Plan every VMA in [start,end) separately, their policies and page
+   offsets differ. */
+static int plan_vmas(struct prefault_plan *pl, char *end)
+{
+	size_t len = 0, psz = pl->pagesize;
+	char *line = NULL, *covered = pl->start;
+	FILE *f;
+	int ret = 0;
+
+	f = fopen("/proc/self/maps", "r");
+	if (!f)	/* no procfs: take it as one anonymous VMA */
+		return plan_vma(pl, pl->start, end,
+				(unsigned long)pl->start / psz);
+	while (ret == 0 && covered < end &&
+	       getdelim(&line, &len, '\n', f) > 0) {
+		unsigned long lo, hi;
+		unsigned long long off;
+		char *ps, *pe;
+
+		if (sscanf(line, "%lx-%lx %*s %llx", &lo, &hi, &off) != 3)
+			continue;
+		if ((char *)hi <= covered)
+			continue;
+		if ((char *)lo > covered)
+			break;
+		ps = covered;
+		pe = (char *)hi < end ? (char *)hi : end;
+		ret = plan_vma(pl, ps, pe, off / psz + (ps - (char *)lo) / psz);
+		covered = pe;
+	}
+	free(line);
+	fclose(f);
+	if (ret == 0 && covered < end) {
+		/* a hole in the range */
+		errno = ENOMEM;
+		ret = -1;
+	}
+	return ret;
+}
+
+int nusa_prefault_memory(void *start, size_t size, size_t pagesize, int flags)
+{
+	struct prefault_plan pl = { NULL, 0, start, pagesize, flags };
+	struct prefault_work *work;
+	unsigned long npages;
+	int i, nwork, err = 0;
+
+	if (!pl.pagesize)
+		pl.pagesize = nusa_pagesize();
+	if (((unsigned long)start % pl.pagesize) || size == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	npages = (size + pl.pagesize - 1) / pl.pagesize;
+
+	pl.nodes = nusa_allocate_nodemask();
+	pl.nodes2 = nusa_allocate_nodemask();
+	if (plan_vmas(&pl, pl.start + npages * pl.pagesize) < 0)
+		goto out_err;
+	work = pl.work;
+	nwork = pl.nwork;
+
+	for (i = 0; i < nwork; i++) {
+		work[i].started = !pthread_create(&work[i].thread, NULL,
+						  prefault_thread, &work[i]);
+		if (!work[i].started) {
+			/* Do it ourselves, without changing our affinity */
+			work[i].node = -1;
+			prefault_thread(&work[i]);
+		}
+	}
+	for (i = 0; i < nwork; i++) {
+		if (work[i].started)
+			pthread_join(work[i].thread, NULL);
+		if (work[i].err && !err)
+			err = work[i].err;
+	}
+	free(work);
+	nusa_bitmask_free(pl.nodes);
+	nusa_bitmask_free(pl.nodes2);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+
+out_err:
+	err = errno;
+	free(pl.work);
+	nusa_bitmask_free(pl.nodes);
+	nusa_bitmask_free(pl.nodes2);
+	errno = err;
+	return -1;
+}
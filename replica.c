@@ -0,0 +1,207 @@
+/* Node replicated read mostly memory.
+
+   libnusa is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; version
+   2.1.
+
+   libnusa is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should find a copy of v2.1 of the GNU Lesser General Public License
+   somewhere on your Linux system; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+   Each node holding a replica has two copies of the region, allocated
+   with nusa_alloc_onnode. A global index says which of the two is
+   current. Readers count themselves in a header in front of the copy,
+   on the copy's node, so readers on different nodes never share a
+   line. The writer fills the other copy on every node, waiting for
+   late readers to leave it first, and then flips the index. */
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nusa.h"
+#include "nusaint.h"
+#include "nusaext.h"
+
+#define REPLICA_HEADER	64	/* header in front of each copy */
+
+struct replica_header {
+	unsigned long readers;
+};
+
+struct nusa_replica {
+	size_t size;
+	int nnodes;
+	int current;			/* copy readers use, 0 or 1 */
+	int *home;			/* node whose replica a node reads */
+	char *(*copy)[2];		/* per node, NULL without a replica */
+	pthread_mutex_t lock;		/* serializes writers */
+	int writer_node;		/* replica the writer fills */
+};
+
+static inline struct replica_header *header(const void *data)
+{
+	return (struct replica_header *)((char *)data - REPLICA_HEADER);
+}
+
+/* Wait for readers that entered a copy just before the last flip */
+static void drain_readers(char *data)
+{
+	while (__atomic_load_n(&header(data)->readers, __ATOMIC_SEQ_CST))
+		sched_yield();
+}
+
+static void free_copies(struct nusa_replica *r)
+{
+	int node, i;
+
+	for (node = 0; node < r->nnodes; node++)
+		for (i = 0; i < 2; i++)
+			if (r->copy[node][i])
+				nusa_free(r->copy[node][i] - REPLICA_HEADER,
+					  r->size + REPLICA_HEADER);
+}
+
+/* Create a zeroed region of size bytes replicated on nodes, NULL for
+   all nodes with memory. */
+struct nusa_replica *nusa_replica_create(size_t size, struct bitmask *nodes)
+{
+	struct nusa_replica *r;
+	int node, k;
+
+	if (!size) {
+		errno = EINVAL;
+		return NULL;
+	}
+	r = calloc(1, sizeof(struct nusa_replica));
+	if (!r)
+		return NULL;
+	r->size = size;
+	r->nnodes = nusa_max_node() + 1;
+	r->home = calloc(r->nnodes, sizeof(int));
+	r->copy = calloc(r->nnodes, sizeof(*r->copy));
+	if (!r->home || !r->copy)
+		goto fail;
+	pthread_mutex_init(&r->lock, NULL);
+	r->writer_node = -1;
+
+	for (node = 0; node < r->nnodes; node++) {
+		int i;
+
+		if (!nusa_bitmask_isbitset(nusa_all_nodes_ptr, node) ||
+		    (nodes && !nusa_bitmask_isbitset(nodes, node)))
+			continue;
+		for (i = 0; i < 2; i++) {
+			char *p = nusa_alloc_onnode(size + REPLICA_HEADER, node);
+
+			if (!p)
+				goto fail;
+			/* fault it in now, readers should not take faults */
+			memset(p, 0, size + REPLICA_HEADER);
+			r->copy[node][i] = p + REPLICA_HEADER;
+		}
+		if (r->writer_node < 0)
+			r->writer_node = node;
+	}
+	if (r->writer_node < 0) {
+		errno = EINVAL;
+		goto fail;
+	}
+	/* nodes without a replica read the nearest one */
+	for (node = 0; node < r->nnodes; node++) {
+		int near = node;
+
+		for (k = 1; near >= 0 && !r->copy[near][0]; k++)
+			near = nusa_nearest_node(node, k);
+		r->home[node] = near >= 0 ? near : r->writer_node;
+	}
+	return r;
+fail:
+	if (r->copy)
+		free_copies(r);
+	free(r->copy);
+	free(r->home);
+	free(r);
+	return NULL;
+}
+
+/* Return the current copy on the caller's node. It stays valid and
+   unchanged until nusa_replica_read_unlock. */
+const void *nusa_replica_read_lock(struct nusa_replica *r)
+{
+	int node = nusa_current_node();
+	char *data;
+	int cur;
+
+	if (node < 0 || node >= r->nnodes)
+		node = r->writer_node;
+	node = r->home[node];
+	for (;;) {
+		cur = __atomic_load_n(&r->current, __ATOMIC_SEQ_CST);
+		data = r->copy[node][cur];
+		__atomic_add_fetch(&header(data)->readers, 1, __ATOMIC_SEQ_CST);
+		/* the writer may have started on this copy meanwhile */
+		if (__atomic_load_n(&r->current, __ATOMIC_SEQ_CST) == cur)
+			return data;
+		__atomic_sub_fetch(&header(data)->readers, 1, __ATOMIC_RELEASE);
+	}
+}
+
+void nusa_replica_read_unlock(struct nusa_replica *r, const void *data)
+{
+	(void)r;
+	__atomic_sub_fetch(&header(data)->readers, 1, __ATOMIC_RELEASE);
+}
+
+/* Start an update: returns a private copy of the current contents to
+   modify. Writers are serialized until nusa_replica_publish. */
+void *nusa_replica_write_begin(struct nusa_replica *r)
+{
+	int cur, node = r->writer_node;
+	char *next;
+
+	pthread_mutex_lock(&r->lock);
+	cur = r->current;
+	next = r->copy[node][!cur];
+	drain_readers(next);
+	memcpy(next, r->copy[node][cur], r->size);
+	return next;
+}
+
+/* Copy the update to every node and make it current. Readers that come
+   later see the new contents, readers already inside keep the old. */
+void nusa_replica_publish(struct nusa_replica *r)
+{
+	int cur = r->current, node;
+	char *src = r->copy[r->writer_node][!cur];
+
+	for (node = 0; node < r->nnodes; node++) {
+		char *dst = r->copy[node][!cur];
+
+		if (!dst || node == r->writer_node)
+			continue;
+		drain_readers(dst);
+		memcpy(dst, src, r->size);
+	}
+	__atomic_store_n(&r->current, !cur, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&r->lock);
+}
+
+/* No readers may be left */
+void nusa_replica_destroy(struct nusa_replica *r)
+{
+	if (!r)
+		return;
+	free_copies(r);
+	pthread_mutex_destroy(&r->lock);
+	free(r->copy);
+	free(r->home);
+	free(r);
+}
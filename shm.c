@@ -26,15 +26,25 @@
 #include <sys/shm.h>
 #include <sys/fcntl.h>
 #include <sys/stat.h>
+#include <sys/vfs.h>
 #include <stdarg.h>
 #include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "nusa.h"
 #include "nusaif.h"
 #include "nusaint.h"
+#include "nusaext.h"
 #include "util.h"
 #include "shm.h"
 
+#ifndef SHM_HUGE_SHIFT
+#define SHM_HUGE_SHIFT	26
+#endif
+#ifndef HUGETLBFS_MAGIC
+#define HUGETLBFS_MAGIC	0x958458f6
+#endif
+
 int shmfd = -1;
 long shmid = 0;
 char *shmptr;
@@ -42,23 +52,81 @@ unsigned long long shmlen;
 mode_t shmmode = 0600;
 unsigned long long shmoffset;
 int shmflags;
+unsigned long long shmhugesize;
 static int shm_pagesize;
+static int shm_created;
+static int shm_writable;	/* mapped writable, see prefault_shm */
 
 long huge_page_size(void)
 {
+	static long size;
 	size_t len = 0;
 	char *line = NULL;
-	FILE *f = fopen("/proc/meminfo", "r");
+	FILE *f;
+
+	if (size)
+		return size;
+	size = getpagesize();
+	f = fopen("/proc/meminfo", "r");
 	if (f != NULL) {
 		while (getdelim(&line, &len, '\n', f) > 0) {
 			int ps;
-			if (sscanf(line, "Hugepagesize: %d kB", &ps) == 1)
-				return ps * 1024;
+			if (sscanf(line, "Hugepagesize: %d kB", &ps) == 1) {
+				size = ps * 1024L;
+				break;
+			}
 		}
 		free(line);
 		fclose(f);
 	}
-	return getpagesize();
+	return size;
+}
+
+/* Page size of the mapping containing addr, from /proc/self/smaps.
+   0 when it cannot be read. */
+static long mapping_pagesize(void *addr)
+{
+	size_t len = 0;
+	char *line = NULL;
+	long size = 0;
+	int found = 0;
+	FILE *f;
+
+	f = fopen("/proc/self/smaps", "r");
+	if (!f)
+		return 0;
+	while (getdelim(&line, &len, '\n', f) > 0) {
+		unsigned long lo, hi;
+		long kb;
+
+		if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2) {
+			if (found)
+				break;
+			found = lo <= (unsigned long)addr &&
+				(unsigned long)addr < hi;
+		} else if (found &&
+			   sscanf(line, "KernelPageSize: %ld kB", &kb) == 1) {
+			size = kb * 1024;
+			break;
+		}
+	}
+	free(line);
+	fclose(f);
+	return size;
+}
+
+/* Check that the kernel has a huge page pool of this size. */
+static void check_huge_size(unsigned long long size)
+{
+	char fn[64];
+
+	if (size & (size - 1))
+		complain("huge page size %llu is not a power of two", size);
+	snprintf(fn, sizeof fn, "/sys/kernel/mm/hugepages/hugepages-%llukB",
+		 size >> 10);
+	if (access(fn, F_OK) < 0)
+		complain("huge page size %lluKB not supported by the kernel",
+			 size >> 10);
 }
 
 static void check_region(char *opt)
@@ -100,6 +168,12 @@ void attach_sysvshm(char *name, char *opt)
 	struct shmid_ds s;
 	key_t key = sysvkey(name);
 
+	if (shmhugesize) {
+		check_huge_size(shmhugesize);
+		shmflags |= SHM_HUGETLB |
+			((ffsll(shmhugesize) - 1) << SHM_HUGE_SHIFT);
+	}
+
 	shmfd = shmget(key, shmlen, shmflags);
 	if (shmfd < 0 && errno == ENOENT) {
 		if (shmlen == 0)
@@ -111,6 +185,7 @@ void attach_sysvshm(char *name, char *opt)
 		shmfd = shmget(key, shmlen, IPC_CREAT|shmmode|shmflags);
 		if (shmfd < 0)
 			nerror("cannot create shared memory segment");
+		shm_created = 1;
 	}
 
 	if (shmlen == 0) {
@@ -119,22 +194,46 @@ void attach_sysvshm(char *name, char *opt)
 		shmlen = s.shm_segsz;
 	}
 
-	shmptr = shmat(shmfd, NULL, SHM_RDONLY);
+	/* Writable when we may, so prefault_shm can fault in for writing */
+	shmptr = shmat(shmfd, NULL, 0);
+	if (shmptr == (void*)-1 && errno == EACCES)
+		shmptr = shmat(shmfd, NULL, SHM_RDONLY);
+	else
+		shm_writable = 1;
 	if (shmptr == (void*)-1)
 		err("shmat");
-	shmptr += shmoffset;
 
-	shm_pagesize = (shmflags & SHM_HUGETLB) ? huge_page_size() : getpagesize();
+	/* An existing segment keeps the page size it was created with,
+	   whatever we asked for */
+	shm_pagesize = mapping_pagesize(shmptr);
+	if (!shm_pagesize) {
+		if (shmhugesize)
+			shm_pagesize = shmhugesize;
+		else
+			shm_pagesize = (shmflags & SHM_HUGETLB) ?
+					huge_page_size() : getpagesize();
+	}
+	if (shmhugesize && shm_pagesize != shmhugesize)
+		complain("segment %s has %dKB pages, not %lluKB", name,
+			 shm_pagesize >> 10, shmhugesize >> 10);
+	shmptr += shmoffset;
 
 	check_region(opt);
 }
 
-/* Attach a shared memory file. */
+/* Attach a shared memory file. This can be a tmpfs or hugetlbfs file,
+   or a memfd opened through /proc/PID/fd/N. */
 void attach_shared(char *name, char *opt)
 {
 	struct stat64 st;
+	struct statfs sfs;
 
-	shmfd = open(name, O_RDONLY);
+	shm_writable = 1;
+	shmfd = open(name, O_RDWR);
+	if (shmfd < 0 && (errno == EACCES || errno == EROFS)) {
+		shm_writable = 0;
+		shmfd = open(name, O_RDONLY);
+	}
 	if (shmfd < 0) {
 		errno = 0;
 		if (shmlen == 0)
@@ -142,9 +241,23 @@ void attach_shared(char *name, char *opt)
 		shmfd = open(name, O_RDWR|O_CREAT, shmmode);
 		if (shmfd < 0)
 			nerror("cannot create file %s", name);
+		shm_created = 1;
+		shm_writable = 1;
 	}
 	if (fstat64(shmfd, &st) < 0)
 		err("shm stat");
+
+	/* hugetlbfs reports its page size as block size */
+	if (fstatfs(shmfd, &sfs) == 0 && sfs.f_type == HUGETLBFS_MAGIC)
+		shm_pagesize = sfs.f_bsize;
+	else
+		shm_pagesize = st.st_blksize;
+	if (shmhugesize && shm_pagesize != shmhugesize)
+		complain("%s is not on a hugetlbfs with %lluKB pages",
+			 name, shmhugesize >> 10);
+
+	check_region(opt);
+
 	if (shmlen > st.st_size) {
 		if (ftruncate64(shmfd, shmlen) < 0) {
 			/* XXX: we could do it by hand, but it would it
@@ -154,18 +267,101 @@ void attach_shared(char *name, char *opt)
 		}
 	}
 
-	shm_pagesize = st.st_blksize;
-
-	check_region(opt);
-
 	/* RED-PEN For shmlen > address space may need to map in pieces.
 	   Left for some poor 32bit soul. */
-	shmptr = mmap64(NULL, shmlen, PROT_READ, MAP_SHARED, shmfd, shmoffset);
+	shmptr = mmap64(NULL, shmlen,
+			PROT_READ | (shm_writable ? PROT_WRITE : 0),
+			MAP_SHARED, shmfd, shmoffset);
 	if (shmptr == (char*)-1)
 		err("shm mmap");
 
 }
 
+static long free_huge_pages(int node, unsigned long long size)
+{
+	char fn[128];
+	long n = -1;
+	FILE *f;
+
+	snprintf(fn, sizeof fn,
+		"/sys/devices/system/node/node%d/hugepages/hugepages-%llukB/free_hugepages",
+		 node, size >> 10);
+	f = fopen(fn, "r");
+	if (f) {
+		if (fscanf(f, "%ld", &n) != 1)
+			n = -1;
+		fclose(f);
+	}
+	return n;
+}
+
+/* Check that the nodes of a policy have enough free huge pages to back a
+   newly created huge page segment, before it gets bound to them.
+   Segments that already existed may be populated already and are not
+   checked. */
+void check_shm_hugepages(int policy, struct bitmask *nodes)
+{
+	unsigned long need, avail = 0;
+	int i, w;
+
+	if (!shm_created || shm_pagesize <= getpagesize())
+		return;
+	need = shmlen / shm_pagesize;
+	w = nusa_bitmask_weight(nodes);
+
+	for (i = nusa_bitmask_next(nodes, 0); i >= 0;
+	     i = nusa_bitmask_next(nodes, i + 1)) {
+		long n;
+
+		n = free_huge_pages(i, shm_pagesize);
+		if (n < 0)
+			complain("cannot read %dKB huge page pool of node %d",
+				 shm_pagesize >> 10, i);
+		switch (policy) {
+		case MPOL_INTERLEAVE:
+			if (n < (need + w - 1) / w)
+				complain(
+		"not enough free %dKB huge pages on node %d: need %lu, %ld free",
+					 shm_pagesize >> 10, i,
+					 (need + w - 1) / w, n);
+			break;
+		case MPOL_PREFERRED:
+			if (n < need)
+				fprintf(stderr,
+	"nusactl: only %ld of %lu %dKB huge pages free on preferred node %d\n",
+					n, need, shm_pagesize >> 10, i);
+			return;
+		case MPOL_BIND:
+		case MPOL_PREFERRED_MANY:
+		case MPOL_WEIGHTED_INTERLEAVE:
+			avail += n;
+			break;
+		}
+	}
+	if (policy == MPOL_PREFERRED_MANY && avail < need)
+		fprintf(stderr,
+	"nusactl: only %lu of %lu %dKB huge pages free on preferred nodes\n",
+			avail, need, shm_pagesize >> 10);
+	/* the weighted share of each node is not known here, only check
+	   the total */
+	if ((policy == MPOL_BIND || policy == MPOL_WEIGHTED_INTERLEAVE) &&
+	    avail < need)
+		complain("not enough free %dKB huge pages on bound nodes: "
+			 "need %lu, %lu free", shm_pagesize >> 10, need, avail);
+}
+
+/* Fault in a shared memory segment according to its policy. Writable
+   when attached writable; a segment we can only read is read faulted,
+   which still allocates its shmem and hugetlbfs pages. */
+void prefault_shm(void)
+{
+	if (shmlen == 0)
+		return;
+	if (nusa_prefault_memory(shmptr, shmlen, shm_pagesize,
+				 shm_writable ? NUSA_PREFAULT_WRITE : 0) < 0)
+		err("prefault shm");
+}
+
 static void
 dumppol(unsigned long long start, unsigned long long end, int pol, struct bitmask *mask)
 {
@@ -198,15 +394,273 @@ void dump_shm(void)
 		if (get_prampolicy(&pol, nodes->maskp, nodes->size, c+shmptr,
 						MPOL_F_ADDR) < 0)
 			err("get_prampolicy on shm");
-		if (pol == prevpol)
+		if (pol == prevpol && nusa_bitmask_equal(nodes, prevnodes))
 			continue;
 		if (prevpol != -1)
 			dumppol(start, c, prevpol, prevnodes);
-		prevnodes = nodes;
+		copy_bitmask_to_bitmask(nodes, prevnodes);
 		prevpol = pol;
 		start = c;
 	}
 	dumppol(start, c, prevpol, prevnodes);
+	nusa_bitmask_free(nodes);
+	nusa_bitmask_free(prevnodes);
+}
+
+struct layout_range {
+	unsigned long long start;
+	unsigned long long end;
+	int policy;
+	struct bitmask *nodes;
+};
+
+static int cmp_range(const void *a, const void *b)
+{
+	const struct layout_range *ra = a, *rb = b;
+
+	if (ra->start < rb->start)
+		return -1;
+	return ra->start > rb->start;
+}
+
+/* Parse one layout line in the format written by dump_shm:
+   START-END: POLICY : NODES
+   START and END are hex offsets into the segment, NODES is a list of
+   nodes separated by spaces or commas, ranges like 0-3 are allowed. */
+static int parse_layout_line(char *line, struct layout_range *r)
+{
+	char polname[32];
+	char *p, *q;
+	int n;
+
+	if (sscanf(line, "%llx-%llx: %31[a-z-] %n", &r->start, &r->end,
+		   polname, &n) != 3)
+		return -1;
+	r->policy = policy_from_name(polname);
+	if (r->policy < 0 || r->end <= r->start)
+		return -1;
+	p = line + n;
+	if (*p == ':')
+		p++;
+	while (*p == ' ' || *p == '\t')
+		p++;
+	for (q = p; *q && *q != '\n' && *q != '#'; q++)
+		if (*q == ' ' || *q == '\t')
+			*q = ',';
+	*q = 0;
+	while (q > p && q[-1] == ',')
+		*--q = 0;
+	if (*p == 0) {
+		if (r->policy != MPOL_DEFAULT && r->policy != MPOL_PREFERRED &&
+		    r->policy != MPOL_LOCAL)
+			return -1;
+		r->nodes = nusa_allocate_nodemask();
+	} else {
+		r->nodes = nusa_parse_nodestring(p);
+		if (!r->nodes)
+			return -1;
+	}
+	return 0;
+}
+
+/* Apply a policy layout file to the attached segment in one pass.
+   Adjacent ranges with the same policy are merged first, so that the
+   number of mbind calls and resulting VMAs stays minimal. */
+void apply_shm_layout(char *name, unsigned flags)
+{
+	struct layout_range *r = NULL;
+	size_t len = 0;
+	char *line = NULL;
+	int i, k, n = 0, lineno = 0;
+	FILE *f;
+
+	f = strcmp(name, "-") ? fopen(name, "r") : stdin;
+	if (!f)
+		nerror("cannot open layout file %s", name);
+	while (getdelim(&line, &len, '\n', f) > 0) {
+		char *p = line;
+
+		lineno++;
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (*p == '#' || *p == '\n' || *p == 0)
+			continue;
+		r = realloc(r, (n + 1) * sizeof(struct layout_range));
+		if (!r)
+			err("realloc");
+		if (parse_layout_line(p, &r[n]) < 0)
+			complain("%s:%d: cannot parse layout line", name, lineno);
+		if (r[n].start < shmoffset || r[n].end > shmoffset + shmlen)
+			complain("%s:%d: range outside of the attached segment",
+				 name, lineno);
+		if ((r[n].start - shmoffset) % shm_pagesize ||
+		    (r[n].end - shmoffset) % shm_pagesize)
+			complain("%s:%d: range not page aligned", name, lineno);
+		n++;
+	}
+	free(line);
+	if (f != stdin)
+		fclose(f);
+
+	qsort(r, n, sizeof(struct layout_range), cmp_range);
+	for (i = 0, k = 0; i < n; i++) {
+		if (k > 0 && r[i].start < r[k-1].end)
+			complain("%s: overlapping ranges at %llx", name,
+				 r[i].start);
+		if (k > 0 && r[i].start == r[k-1].end &&
+		    r[i].policy == r[k-1].policy &&
+		    nusa_bitmask_equal(r[i].nodes, r[k-1].nodes)) {
+			r[k-1].end = r[i].end;
+			nusa_bitmask_free(r[i].nodes);
+			continue;
+		}
+		r[k++] = r[i];
+	}
+
+	for (i = 0; i < k; i++) {
+		if (mbind(shmptr + (r[i].start - shmoffset),
+			  r[i].end - r[i].start, r[i].policy,
+			  r[i].nodes->maskp, r[i].nodes->size + 1, flags) < 0)
+			nerror("mbind of %llx-%llx", r[i].start, r[i].end);
+		nusa_bitmask_free(r[i].nodes);
+	}
+	free(r);
+}
+
+#define MIGRATE_BATCH	1024	/* pages per move_pages call */
+
+struct migrate_state {
+	int policy;
+	struct bitmask *nodes;
+	int *tnodes;		/* target nodes in interleave order */
+	int ntnodes;
+	int flags;
+	unsigned long long moved;
+	unsigned long long failed;
+	int target[MIGRATE_BATCH];
+	int status[MIGRATE_BATCH];
+};
+
+/* Node a page should end up on under the new policy, or -1 if its
+   current node already conforms. Interleave follows the kernel, which
+   rotates by the page offset in the segment. */
+static int migrate_target(struct migrate_state *ms, char *p, int node)
+{
+	unsigned long long off = (shmoffset + (p - shmptr)) / shm_pagesize;
+	int t;
+
+	switch (ms->policy) {
+	case MPOL_INTERLEAVE:
+		t = ms->tnodes[off % ms->ntnodes];
+		break;
+	case MPOL_PREFERRED:
+		t = ms->tnodes[0];
+		break;
+	default:
+		if (node >= 0 && nusa_bitmask_isbitset(ms->nodes, node))
+			return -1;
+		t = ms->tnodes[off % ms->ntnodes];
+		break;
+	}
+	return t == node ? -1 : t;
+}
+
+static void migrate_batch(struct migrate_state *ms, void **pages, int n)
+{
+	int i, k;
+
+	if (move_pages(0, n, pages, NULL, ms->status, 0) < 0)
+		err("move_pages");
+	for (i = 0, k = 0; i < n; i++) {
+		int t = migrate_target(ms, pages[i], ms->status[i]);
+
+		if (t < 0)
+			continue;
+		pages[k] = pages[i];
+		ms->target[k++] = t;
+	}
+	if (k == 0)
+		return;
+	while (move_pages(0, k, pages, ms->target, ms->status, ms->flags) < 0) {
+		if (errno != EPERM || ms->flags != MPOL_MF_MOVE_ALL)
+			err("move_pages");
+		fprintf(stderr,
+	"nusactl: no permission to move shared pages, moving unshared pages only\n");
+		ms->flags = MPOL_MF_MOVE;
+	}
+	for (i = 0; i < k; i++) {
+		if (ms->status[i] == ms->target[i])
+			ms->moved++;
+		else
+			ms->failed++;
+	}
+}
+
+/* Migrate the pages of the attached segment range to nodes and set the
+   range policy so that future faults land there too.
+   Only pages that are already allocated are moved. Pages shared with
+   other processes need MPOL_MF_MOVE_ALL, which needs CAP_SYS_NICE. */
+void migrate_shm(int policy, struct bitmask *nodes)
+{
+	struct migrate_state ms = {
+		.policy = policy,
+		.nodes = nodes,
+		.flags = MPOL_MF_MOVE_ALL,
+	};
+	void *pages[MIGRATE_BATCH];
+	unsigned char *vec = NULL;
+	unsigned long long c, pg;
+	int i, n = 0;
+
+	if (shmlen == 0)
+		return;
+	if (policy == MPOL_DEFAULT || nusa_bitmask_weight(nodes) == 0)
+		complain("need target nodes to migrate a shared memory segment");
+
+	ms.tnodes = malloc(nusa_bitmask_weight(nodes) * sizeof(int));
+	if (!ms.tnodes)
+		err("malloc");
+	for (i = nusa_bitmask_next(nodes, 0); i >= 0;
+	     i = nusa_bitmask_next(nodes, i + 1))
+		ms.tnodes[ms.ntnodes++] = i;
+
+	if (mbind(shmptr, shmlen, policy, nodes->maskp, nodes->size + 1, 0) < 0)
+		err("mbind");
+
+	/* mincore reports the page cache state of tmpfs/shm, so holes can
+	   be skipped instead of being allocated by the touch below.
+	   For hugetlb it only reports our own page tables, so there all
+	   pages are touched. */
+	if (shm_pagesize == getpagesize()) {
+		vec = malloc(shmlen / shm_pagesize);
+		if (!vec)
+			err("malloc");
+		if (mincore(shmptr, shmlen, vec) < 0) {
+			free(vec);
+			vec = NULL;
+		}
+	}
+
+	for (c = 0, pg = 0; c < shmlen; c += shm_pagesize, pg++) {
+		if (vec && !(vec[pg] & 1))
+			continue;
+		/* Map the page into our page tables so move_pages sees it */
+		(void)*(volatile char *)(shmptr + c);
+		pages[n++] = shmptr + c;
+		if (n == MIGRATE_BATCH) {
+			migrate_batch(&ms, pages, n);
+			n = 0;
+		}
+	}
+	if (n > 0)
+		migrate_batch(&ms, pages, n);
+	free(vec);
+	free(ms.tnodes);
+
+	if (ms.failed)
+		exitcode = 1;
+	printf("nusactl: migrated %llu pages, %llu could not be moved\n",
+	       ms.moved, ms.failed);
 }
 
 static void dumpnode(unsigned long long start, unsigned long long end, int node)
@@ -251,75 +705,337 @@ static void vwarn(char *ptr, char *fmt, ...)
 	exitcode = 1;
 }
 
-static unsigned interleave_next(unsigned cur, struct bitmask *mask)
+#define VERIFY_BATCH	512			/* pages per move_pages call */
+#define VERIFY_CHUNK	(64 * VERIFY_BATCH)	/* pages per work item */
+#define VERIFY_REPORT	16			/* detailed reports printed */
+
+struct verify_chunk {
+	char *start;
+	char *end;
+};
+
+struct verify_state {
+	int policy;
+	struct bitmask *nodes;
+	int *ilnodes;		/* nodes of the mask in interleave order */
+	int nilnodes;
+	struct verify_chunk *chunks;
+	unsigned long nchunks;
+	unsigned long nextchunk;
+	unsigned long long pages;
+	unsigned long misplaced;
+	unsigned long missing;
+	unsigned long badpolicy;
+	int reported;
+	pthread_mutex_t lock;
+};
+
+/* Interleave node of the page at p. Like migrate_target, follow the
+   kernel, which rotates by the page offset in the segment. */
+static int verify_il_node(struct verify_state *vs, char *p)
+{
+	unsigned long long off = (shmoffset + (p - shmptr)) / shm_pagesize;
+
+	return vs->ilnodes[off % vs->nilnodes];
+}
+
+/* Report a mismatch. Only the first few are printed in detail, the
+   rest only show up in the summary. */
+static void verify_report(struct verify_state *vs, char *p, int node)
 {
-	int nusa_num_nodes = nusa_num_possible_nodes();
+	int expected = -1;
 
-	++cur;
-	while (!nusa_bitmask_isbitset(mask, cur)) {
-		cur = (cur+1) % nusa_num_nodes;
+	pthread_mutex_lock(&vs->lock);
+	exitcode = 1;
+	if (vs->reported++ >= VERIFY_REPORT) {
+		pthread_mutex_unlock(&vs->lock);
+		return;
+	}
+	if (node < 0) {
+		vwarn(p, "cannot get node of page: %s\n", strerror(-node));
+	} else if (vs->policy == MPOL_INTERLEAVE) {
+		if (!nusa_bitmask_isbitset(vs->nodes, node))
+			vwarn(p, "interleave node out of range %d\n", node);
+		else {
+			expected = verify_il_node(vs, p);
+			vwarn(p, "expected interleave node %d, got %d\n",
+			      expected, node);
+		}
+	} else {
+		vwarn(p, "unexpected node %d\n", node);
+		printmask("expected", vs->nodes);
 	}
-	return cur;
+	pthread_mutex_unlock(&vs->lock);
 }
 
-/* Verify policy in a shared memory segment */
-void verify_shm(int policy, struct bitmask *nodes)
+/* Check node residency of the pages in [start,end). The pages are touched
+   first so that they get allocated according to the policy, then their
+   nodes are queried a batch at a time with move_pages. */
+static unsigned long verify_pages(struct verify_state *vs, char *start,
+				  char *end, void **pages, int *status)
 {
+	unsigned long bad = 0;
 	char *p;
-	int ilnode, node;
-	int pol2;
-	struct bitmask *nodes2;
+	int i, n;
 
-	nodes2 = nusa_allocate_nodemask();
+	while (start < end) {
+		for (n = 0, p = start; n < VERIFY_BATCH && p < end;
+		     n++, p += shm_pagesize) {
+			(void)*(volatile char *)p;
+			pages[n] = p;
+		}
+		if (move_pages(0, n, pages, NULL, status, 0) < 0)
+			err("move_pages");
 
-	if (policy == MPOL_INTERLEAVE) {
-		if (get_prampolicy(&ilnode, NULL, 0, shmptr,
-					MPOL_F_ADDR|MPOL_F_NODE)
-		    < 0)
-			err("get_prampolicy");
+		for (i = 0; i < n; i++) {
+			int node = status[i];
+
+			switch (vs->policy) {
+			case MPOL_INTERLEAVE:
+				if (node >= 0 &&
+				    node == verify_il_node(vs, pages[i]))
+					continue;
+				break;
+			case MPOL_PREFERRED:
+			case MPOL_PREFERRED_MANY:
+			case MPOL_BIND:
+			case MPOL_WEIGHTED_INTERLEAVE:
+				if (node >= 0 &&
+				    nusa_bitmask_isbitset(vs->nodes, node))
+					continue;
+				break;
+			default:
+				continue;
+			}
+			if (node < 0)
+				__sync_fetch_and_add(&vs->missing, 1);
+			bad++;
+			verify_report(vs, pages[i], node);
+		}
+		start = p;
 	}
+	return bad;
+}
 
-	for (p = shmptr; p - (char *)shmptr < shmlen; p += shm_pagesize) {
-		if (get_prampolicy(&pol2, nodes2->maskp, nodes2->size, p,
-							MPOL_F_ADDR) < 0)
-			err("get_prampolicy");
-		if (pol2 != policy) {
-			vwarn(p, "wrong policy %s, expected %s\n",
-			      policy_name(pol2), policy_name(policy));
-			return;
+static void *verify_thread(void *arg)
+{
+	struct verify_state *vs = arg;
+	void **pages = malloc(VERIFY_BATCH * sizeof(void *));
+	int *status = malloc(VERIFY_BATCH * sizeof(int));
+	unsigned long k, bad = 0;
+
+	if (!pages || !status)
+		err("malloc");
+	while ((k = __sync_fetch_and_add(&vs->nextchunk, 1)) < vs->nchunks)
+		bad += verify_pages(vs, vs->chunks[k].start, vs->chunks[k].end,
+				    pages, status);
+	__sync_fetch_and_add(&vs->misplaced, bad);
+	free(pages);
+	free(status);
+	return NULL;
+}
+
+/* Return the boundaries of the VMAs covering [start,end) in *bounds,
+   including start and end themselves. mbind on a shared segment splits
+   the VMA in the calling process, so the policy only needs to be read once
+   per VMA instead of once per page. */
+static int shm_vma_bounds(char *start, char *end, char ***bounds)
+{
+	size_t len = 0;
+	char *line = NULL;
+	int n = 0, max = 16;
+	char **b = malloc(max * sizeof(char *));
+	FILE *f;
+
+	if (!b)
+		err("malloc");
+	b[n++] = start;
+	f = fopen("/proc/self/maps", "r");
+	if (f) {
+		while (getdelim(&line, &len, '\n', f) > 0) {
+			unsigned long lo, hi;
+
+			if (sscanf(line, "%lx-%lx", &lo, &hi) != 2)
+				continue;
+			if ((char *)lo <= start || (char *)lo >= end)
+				continue;
+			if (n + 1 >= max) {
+				max *= 2;
+				b = realloc(b, max * sizeof(char *));
+				if (!b)
+					err("realloc");
+			}
+			b[n++] = (char *)lo;
 		}
-		if (memcmp(nodes2, nodes, nusa_bitmask_nbytes(nodes))) {
-			vwarn(p, "mismatched node mask\n");
-			printmask("expected", nodes);
-			printmask("real", nodes2);
+		free(line);
+		fclose(f);
+	}
+	b[n++] = end;
+	*bounds = b;
+	return n;
+}
+
+/* Add [start,end) to the work items, growing the last one when it ends
+   at start and is not full yet. */
+static void verify_add_chunks(struct verify_state *vs, char *start, char *end)
+{
+	unsigned long step = (unsigned long)VERIFY_CHUNK * shm_pagesize;
+
+	while (start < end) {
+		struct verify_chunk *last = vs->nchunks ?
+				&vs->chunks[vs->nchunks - 1] : NULL;
+		char *e = (unsigned long)(end - start) > step ? start + step : end;
+
+		if (last && last->end == start &&
+		    (unsigned long)(last->end - last->start) < step) {
+			e = (unsigned long)(end - last->start) > step ?
+				last->start + step : end;
+			last->end = e;
+			start = e;
+			continue;
 		}
+		vs->chunks = realloc(vs->chunks,
+				(vs->nchunks + 1) * sizeof(struct verify_chunk));
+		if (!vs->chunks)
+			err("realloc");
+		vs->chunks[vs->nchunks].start = start;
+		vs->chunks[vs->nchunks].end = e;
+		vs->nchunks++;
+		start = e;
+	}
+}
 
-		if (get_prampolicy(&node, NULL, 0, p, MPOL_F_ADDR|MPOL_F_NODE) < 0)
+/* 1 when the policy read every step bytes of [start,end) is the same
+   everywhere. a and b are scratch masks. */
+static int vma_uniform(char *start, char *end, unsigned long step,
+		       struct bitmask *a, struct bitmask *b)
+{
+	int pol, pol2;
+	char *p;
+
+	if (get_prampolicy(&pol, a->maskp, a->size, start, MPOL_F_ADDR) < 0)
+		err("get_prampolicy");
+	for (p = start + step; p < end; p += step) {
+		if (get_prampolicy(&pol2, b->maskp, b->size, p,
+				   MPOL_F_ADDR) < 0)
 			err("get_prampolicy");
+		if (pol2 != pol || !nusa_bitmask_equal(a, b))
+			return 0;
+	}
+	return 1;
+}
 
-		switch (policy) {
-		case MPOL_INTERLEAVE:
-			if (node < 0 || !nusa_bitmask_isbitset(nodes2, node))
-				vwarn(p, "interleave node out of range %d\n", node);
-			if (node != ilnode) {
-				vwarn(p, "expected interleave node %d, got %d\n",
-				     ilnode,node);
-				return;
+/* Verify policy in a shared memory segment.
+   A shared segment can carry policies on sub-ranges set by other
+   processes, which do not split our VMAs. So the policy is sampled
+   every VERIFY_BATCH pages of each VMA, and a VMA whose samples differ
+   is then checked page by page. In a VMA that looks uniform a smaller
+   range with another policy can still hide between two samples; the
+   summary says how many pages were only sampled. The node residency
+   of the pages is checked only where the policy restricts it, in
+   parallel over all CPUs; default and local ranges start no threads.
+   All mismatches are counted and summarized at the end. */
+void verify_shm(int policy, struct bitmask *nodes)
+{
+	struct verify_state vs = {
+		.policy = policy,
+		.nodes = nodes,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	};
+	struct bitmask *nodes2, *nodes3;
+	unsigned long long sampled = 0;
+	pthread_t *threads;
+	char **bounds;
+	int i, nbounds, nthreads;
+
+	nodes2 = nusa_allocate_nodemask();
+	nodes3 = nusa_allocate_nodemask();
+
+	nbounds = shm_vma_bounds(shmptr, shmptr + shmlen, &bounds);
+	for (i = 0; i < nbounds - 1; i++) {
+		unsigned long step = (unsigned long)VERIFY_BATCH * shm_pagesize;
+		char *p, *q, *end = bounds[i + 1];
+		int pol2, bad = 0;
+
+		if (vma_uniform(bounds[i], end, step, nodes2, nodes3))
+			sampled += (end - bounds[i]) / shm_pagesize;
+		else
+			step = shm_pagesize;
+
+		/* a run of bad steps is reported as one range */
+		for (p = bounds[i]; p < end; p = q) {
+			q = (unsigned long)(end - p) > step ? p + step : end;
+			if (get_prampolicy(&pol2, nodes2->maskp, nodes2->size,
+					   p, MPOL_F_ADDR) < 0)
+				err("get_prampolicy");
+			if (pol2 != policy) {
+				if (!bad++) {
+					vwarn(p, "wrong policy %s, expected %s\n",
+					      policy_name(pol2),
+					      policy_name(policy));
+					vs.badpolicy++;
+				}
+				continue;
 			}
-			ilnode = interleave_next(ilnode, nodes2);
-			break;
-		case MPOL_PREFERRED:
-		case MPOL_BIND:
-			if (!nusa_bitmask_isbitset(nodes2, node)) {
-				vwarn(p, "unexpected node %d\n", node);
-				printmask("expected", nodes2);
+			if (policy != MPOL_DEFAULT && policy != MPOL_LOCAL &&
+			    !nusa_bitmask_equal(nodes2, nodes)) {
+				if (!bad++) {
+					vwarn(p, "mismatched node mask\n");
+					printmask("expected", nodes);
+					printmask("real", nodes2);
+					vs.badpolicy++;
+				}
+				continue;
 			}
-			break;
+			bad = 0;
+			if (policy == MPOL_INTERLEAVE ||
+			    policy == MPOL_PREFERRED ||
+			    policy == MPOL_PREFERRED_MANY ||
+			    policy == MPOL_BIND ||
+			    policy == MPOL_WEIGHTED_INTERLEAVE)
+				verify_add_chunks(&vs, p, q);
+		}
+	}
+	free(bounds);
+	nusa_bitmask_free(nodes2);
+	nusa_bitmask_free(nodes3);
 
-		case MPOL_DEFAULT:
-			break;
+	if (policy == MPOL_INTERLEAVE && vs.nchunks > 0) {
+		int w = nusa_bitmask_weight(nodes);
 
-		}
+		vs.ilnodes = malloc(w * sizeof(int));
+		if (!vs.ilnodes)
+			err("malloc");
+		for (i = nusa_bitmask_next(nodes, 0); i >= 0;
+		     i = nusa_bitmask_next(nodes, i + 1))
+			vs.ilnodes[vs.nilnodes++] = i;
+	}
+
+	vs.pages = shmlen / shm_pagesize;
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > vs.nchunks)
+		nthreads = vs.nchunks;
+	if (nthreads > 0) {
+		threads = malloc(nthreads * sizeof(pthread_t));
+		if (!threads)
+			err("malloc");
+		for (i = 0; i < nthreads; i++)
+			if (pthread_create(&threads[i], NULL, verify_thread,
+					   &vs))
+				err("pthread_create");
+		for (i = 0; i < nthreads; i++)
+			pthread_join(threads[i], NULL);
+		free(threads);
 	}
+	free(vs.chunks);
+	free(vs.ilnodes);
 
+	if (vs.badpolicy || vs.misplaced)
+		printf("nusactl verify: %llu pages, %lu ranges with wrong policy, "
+		       "%lu misplaced pages (%lu not present)\n",
+		       vs.pages, vs.badpolicy, vs.misplaced, vs.missing);
+	if (sampled)
+		printf("nusactl verify: policy of %llu pages sampled every %d "
+		       "pages, a policy on a smaller range there may be missed\n",
+		       sampled, VERIFY_BATCH);
 }
@@ -6,12 +6,18 @@ extern unsigned long long shmlen;
 extern mode_t shmmode;
 extern unsigned long long shmoffset;
 extern int shmflags;
+extern unsigned long long shmhugesize;
 
 extern void dump_shm(void);
 extern void dump_shm_nodes(void);
 extern void attach_shared(char *, char *);
 extern void attach_sysvshm(char *, char *);
 extern void verify_shm(int policy, struct bitmask *);
+extern void prefault_shm(void);
+extern void migrate_shm(int policy, struct bitmask *);
+extern void apply_shm_layout(char *name, unsigned flags);
+extern void check_shm_hugepages(int policy, struct bitmask *);
+extern long huge_page_size(void);
 
 /* in nusactl.c */
 extern int exitcode;
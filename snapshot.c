@@ -0,0 +1,237 @@
+/* Persistent binary snapshot of the NUMA topology.
+
+   libnusa is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; version
+   2.1.
+
+   libnusa is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should find a copy of v2.1 of the GNU Lesser General Public License
+   somewhere on your Linux system; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+   Scanning sysfs costs one file per node for the distances alone, which
+   adds up for many short lived processes on big machines. A snapshot
+   written once (for example at boot) is mapped instead. It is only
+   trusted when the boot id and the online node and cpu lists still
+   match, so a reboot or hotplug invalidates it. */
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "nusa.h"
+#include "nusaint.h"
+#include "nusaext.h"
+#include "snapshot.h"
+#include "sysfs.h"
+#include "topology.h"
+
+static const struct topo_snapshot *snapshot;
+static pthread_once_t snapshot_once = PTHREAD_ONCE_INIT;
+
+static const char *snapshot_path(void)
+{
+	const char *path = secure_getenv("NUSA_TOPOLOGY_SNAPSHOT");
+	return path && *path ? path : SNAPSHOT_PATH;
+}
+
+/* Read a small identity file into buf, zero padded. Returns its length,
+   or -1 when it cannot be read or does not fit. */
+static int read_ident(const char *name, char *buf, int len)
+{
+	int n, fd = open(name, O_RDONLY|O_CLOEXEC);
+
+	memset(buf, 0, len);
+	if (fd < 0)
+		return -1;
+	n = read(fd, buf, len);
+	close(fd);
+	if (n == len) {
+		errno = EOVERFLOW;
+		return -1;
+	}
+	return n;
+}
+
+/* 1 when file name still has the len bytes at off in s */
+static int ident_current(const struct topo_snapshot *s, const char *name,
+			 uint32_t off, uint32_t len)
+{
+	char buf[SYSFS_BLOCK];
+	int n = read_ident(name, buf, sizeof buf);
+
+	return n >= 0 && n == len && !memcmp(buf, (const char *)s + off, n);
+}
+
+static int snapshot_current(const struct topo_snapshot *s)
+{
+	char buf[sizeof s->boot_id];
+
+	if (read_ident("/proc/sys/kernel/random/boot_id", buf, sizeof buf) < 0 ||
+	    memcmp(buf, s->boot_id, sizeof buf))
+		return 0;
+	return ident_current(s, "/sys/devices/system/node/online",
+			     s->node_online_off, s->node_online_len) &&
+	       ident_current(s, "/sys/devices/system/cpu/online",
+			     s->cpu_online_off, s->cpu_online_len);
+}
+
+static int snapshot_valid(const struct topo_snapshot *s, size_t size)
+{
+	if (size < sizeof(struct topo_snapshot) || s->size != size ||
+	    memcmp(s->magic, SNAPSHOT_MAGIC, sizeof s->magic) ||
+	    s->version != SNAPSHOT_VERSION ||
+	    s->nnodes <= 0 || s->ncpus <= 0)
+		return 0;
+	if (s->cpu_node_off + (uint64_t)s->ncpus * sizeof(int32_t) > size ||
+	    s->distance_off +
+	    (uint64_t)s->nnodes * s->nnodes * sizeof(int32_t) > size ||
+	    (uint64_t)s->node_online_off + s->node_online_len > size ||
+	    (uint64_t)s->cpu_online_off + s->cpu_online_len > size)
+		return 0;
+	return snapshot_current(s);
+}
+
+static void map_snapshot(void)
+{
+	struct stat st;
+	void *map;
+	int fd = open(snapshot_path(), O_RDONLY|O_CLOEXEC);
+
+	if (fd < 0)
+		return;
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct topo_snapshot)) {
+		close(fd);
+		return;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return;
+	if (!snapshot_valid(map, st.st_size)) {
+		munmap(map, st.st_size);
+		return;
+	}
+	snapshot = map;
+}
+
+/* Return the mapped snapshot, or NULL when there is no valid one. */
+hidden const struct topo_snapshot *topo_snapshot(void)
+{
+	pthread_once(&snapshot_once, map_snapshot);
+	return snapshot;
+}
+
+/* Write a snapshot of the current topology to path (NULL for the
+   default location). The file is replaced atomically. */
+int nusa_write_topology_snapshot(const char *path)
+{
+	const struct bitmask *online = topo_nodes();
+	struct topo_snapshot *s;
+	int32_t *cpu_node, *dist;
+	char node_online[SYSFS_BLOCK], cpu_online[SYSFS_BLOCK];
+	int node_len, cpu_len;
+	int i, j, fd, nnodes, ncpus, err;
+	size_t size;
+	char *tmp, *dir, *p;
+
+	if (!path)
+		path = snapshot_path();
+	nnodes = topo_num_nodes();
+	ncpus = topo_num_cpus();
+	if (!online || ncpus <= 0) {
+		errno = ENODEV;
+		return -1;
+	}
+	/* stored whole, a truncated list could match another topology */
+	node_len = read_ident("/sys/devices/system/node/online", node_online,
+			      sizeof node_online);
+	cpu_len = read_ident("/sys/devices/system/cpu/online", cpu_online,
+			     sizeof cpu_online);
+	if (node_len < 0 || cpu_len < 0)
+		return -1;
+
+	size = sizeof(struct topo_snapshot);
+	size = round_up(size + ncpus * sizeof(int32_t), 8);
+	size += nnodes * nnodes * sizeof(int32_t);
+	size += node_len + cpu_len;
+	s = calloc(1, size);
+	if (!s)
+		return -1;
+
+	memcpy(s->magic, SNAPSHOT_MAGIC, sizeof s->magic);
+	s->version = SNAPSHOT_VERSION;
+	s->size = size;
+	if (read_ident("/proc/sys/kernel/random/boot_id", s->boot_id,
+		       sizeof s->boot_id) < 0) {
+		free(s);
+		return -1;
+	}
+	s->nnodes = nnodes;
+	s->ncpus = ncpus;
+	s->cpu_node_off = sizeof(struct topo_snapshot);
+	s->distance_off = round_up(s->cpu_node_off +
+				   ncpus * sizeof(int32_t), 8);
+	s->node_online_off = s->distance_off + nnodes * nnodes * sizeof(int32_t);
+	s->node_online_len = node_len;
+	s->cpu_online_off = s->node_online_off + node_len;
+	s->cpu_online_len = cpu_len;
+	memcpy((char *)s + s->node_online_off, node_online, node_len);
+	memcpy((char *)s + s->cpu_online_off, cpu_online, cpu_len);
+
+	cpu_node = (int32_t *)((char *)s + s->cpu_node_off);
+	dist = (int32_t *)((char *)s + s->distance_off);
+	for (i = 0; i < ncpus; i++)
+		cpu_node[i] = topo_cpu_node(i);
+	for (i = 0; i < nnodes; i++) {
+		if (!nusa_bitmask_isbitset(online, i))
+			continue;
+		for (j = 0; j < nnodes; j++)
+			dist[i * nnodes + j] = nusa_distance(i, j);
+	}
+
+	if (asprintf(&tmp, "%s.%d", path, getpid()) < 0) {
+		free(s);
+		return -1;
+	}
+	dir = strdup(path);
+	if (dir && (p = strrchr(dir, '/')) != NULL && p != dir) {
+		*p = 0;
+		mkdir(dir, 0755);
+	}
+	free(dir);
+
+	fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (fd < 0)
+		goto out;
+	if (write(fd, s, size) != size) {
+		close(fd);
+		goto out_unlink;
+	}
+	if (close(fd) < 0 || rename(tmp, path) < 0)
+		goto out_unlink;
+	free(tmp);
+	free(s);
+	return 0;
+
+out_unlink:
+	err = errno;
+	unlink(tmp);
+	errno = err;
+out:
+	err = errno;
+	free(tmp);
+	free(s);
+	errno = err;
+	return -1;
+}
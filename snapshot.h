@@ -0,0 +1,31 @@
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H 1
+
+#include <stdint.h>
+
+#define SNAPSHOT_MAGIC		"NUSATOP"
+#define SNAPSHOT_VERSION	3
+#define SNAPSHOT_PATH		"/run/nusa/topology"
+
+/* Binary topology snapshot. The variable sized arrays follow the header
+   at the given offsets. All offsets are from the start of the file. */
+struct topo_snapshot {
+	char magic[8];
+	uint32_t version;
+	uint32_t size;			/* size of the whole file */
+	char boot_id[40];		/* kernel boot the snapshot is from */
+	int32_t nnodes;			/* highest online node + 1 */
+	int32_t ncpus;			/* /sys/devices/system/cpu/possible */
+	uint32_t cpu_node_off;		/* int32_t [ncpus], -1 for none */
+	uint32_t distance_off;		/* int32_t [nnodes * nnodes] */
+	uint32_t node_online_off;	/* /sys/devices/system/node/online */
+	uint32_t node_online_len;
+	uint32_t cpu_online_off;	/* /sys/devices/system/cpu/online */
+	uint32_t cpu_online_len;
+};
+
+#define SNAPSHOT_ARRAY(s, type, off) ((const type *)((const char *)(s) + (s)->off))
+
+hidden const struct topo_snapshot *topo_snapshot(void);
+
+#endif
@@ -4,6 +4,8 @@
 #include <limits.h>
 #include <sys/time.h>
 #include <stdlib.h>
+#include <string.h>
+#include "nusaext.h"
 #include "stream_lib.h"
 
 static inline double mysecond()
@@ -202,6 +204,91 @@ void stream_test(double *res)
 	}
 }
 
+static char *bulk_label[STREAM_NBULK] = {
+	"memcpy:    ", "Bulk copy: ", "memset:    ", "Bulk fill: "
+};
+char *stream_bulk_names[] = { "memcpy","BulkCopy","memset","BulkFill" };
+
+/* Plain memcpy/memset against nusa_bulk_copy/fill on the same arrays */
+void stream_bulk_test(double *res)
+{
+	size_t len = sizeof(double) * N;
+	double best[STREAM_NBULK], t;
+	int j, k;
+
+	for (j = 0; j < STREAM_NBULK; j++)
+		best[j] = FLT_MAX;
+	for (k = 0; k < NTIMES; k++) {
+		t = mysecond();
+		memcpy(c, a, len);
+		best[0] = MIN(best[0], mysecond() - t);
+
+		t = mysecond();
+		nusa_bulk_copy(c, a, len, NULL);
+		best[1] = MIN(best[1], mysecond() - t);
+
+		t = mysecond();
+		memset(c, 0, len);
+		best[2] = MIN(best[2], mysecond() - t);
+
+		t = mysecond();
+		nusa_bulk_fill(c, 0, len, NULL);
+		best[3] = MIN(best[3], mysecond() - t);
+	}
+
+	Vprintf("Function      Rate (MB/s)   Min time\n");
+	for (j = 0; j < STREAM_NBULK; j++) {
+		/* copies read and write, fills only write */
+		double speed = 1.0E-06 * (j < 2 ? 2 : 1) * len / best[j];
+
+		Vprintf("%s%11.4f  %11.4f\n", bulk_label[j], speed, best[j]);
+		if (res)
+			res[j] = speed;
+	}
+}
+
+/* Triad bandwidth in MB/s of memory on node, as seen from the calling
+   cpu. Uses the same array sizes as stream_test; call stream_init
+   again before the next stream_test. */
+double stream_node_bandwidth(int node)
+{
+	long size = stream_memsize();
+	double res[STREAM_NRESULTS];
+	int verbose = stream_verbose;
+	void *mem;
+
+	mem = nusa_alloc_onnode(size, node);
+	if (!mem)
+		return -1;
+	stream_verbose = 0;
+	stream_init(mem);
+	stream_test(res);
+	stream_verbose = verbose;
+	nusa_free(mem, size);
+	return res[3];
+}
+
+/* Measure the nodes in nodes one after another and derive weighted
+   interleave weights from their bandwidth, indexed by node. With set,
+   also write them to the kernel. Returns 0 or -1. */
+int stream_calibrate_weights(struct bitmask *nodes, double *bw, int *weights,
+			     int set)
+{
+	int i, n = nusa_max_node() + 1;
+
+	for (i = 0; i < n; i++) {
+		bw[i] = 0;
+		if (nusa_bitmask_isbitset(nodes, i))
+			bw[i] = stream_node_bandwidth(i);
+	}
+	if (nusa_interleave_weights_from_bandwidth(bw, weights, n) < 0)
+		return -1;
+	for (i = 0; set && i < n; i++)
+		if (weights[i] && nusa_set_interleave_weight(i, weights[i]) < 0)
+			return -1;
+	return 0;
+}
+
 # define	M	20
 
 int checktick()
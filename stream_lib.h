@@ -3,6 +3,13 @@ long stream_init(void *mem);
 #define STREAM_NRESULTS 4
 void stream_test(double *res);
 void stream_check(void);
+#define STREAM_NBULK 4
+void stream_bulk_test(double *res);
+struct bitmask;
+double stream_node_bandwidth(int node);
+int stream_calibrate_weights(struct bitmask *nodes, double *bw, int *weights,
+			     int set);
 void stream_setmem(unsigned long size);
 extern int stream_verbose;
 extern char *stream_names[];
+extern char *stream_bulk_names[];
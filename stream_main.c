@@ -1,8 +1,10 @@
 #include <stdio.h>
 #include <sys/mman.h>
 #include <stdlib.h>
+#include <string.h>
 #include "nusa.h"
 #include "nusaif.h"
+#include "nusaext.h"
 #include "util.h"
 #include "stream_lib.h"
 
@@ -13,14 +15,58 @@ void usage(void)
 
 char *policy = "default";
 
-/* Run STREAM with a nusa policy */
+/* calibrate [nodes] [set]: derive weighted interleave weights from the
+   bandwidth of each node */
+static int calibrate(char *nodestr, int set)
+{
+	int i, n = nusa_max_node() + 1;
+	struct bitmask *nodes;
+	double *bw;
+	int *weights;
+
+	nodes = nodestr ? nusa_parse_nodestring(nodestr) : nusa_all_nodes_ptr;
+	if (!nodes) {
+		printf ("<%s> is invalid\n", nodestr);
+		exit(1);
+	}
+	bw = calloc(n, sizeof(double));
+	weights = calloc(n, sizeof(int));
+	if (!bw || !weights)
+		exit(1);
+	if (stream_calibrate_weights(nodes, bw, weights, set) < 0)
+		perror("calibrate"), exit(1);
+	for (i = 0; i < n; i++)
+		if (bw[i] > 0)
+			printf("node %d %11.4f MB/s weight %d\n", i, bw[i],
+			       weights[i]);
+	return 0;
+}
+
+/* Run STREAM with a nusa policy:
+   stream_numa [-b] [policy [nodes]], -b adds the bulk copy comparison
+   stream_numa calibrate [nodes] [set] */
 int main(int ac, char **av)
 {
 	struct bitmask *nodes;
-	char *map;
+	char *map, *nodestr = NULL;
 	long size;
-	int policy;
+	int policy, i, set = 0, bulk = 0;
 
+	if (av[1] && !strcmp(av[1], "calibrate")) {
+		for (i = 2; i < ac; i++) {
+			if (!strcmp(av[i], "set"))
+				set = 1;
+			else if (!nodestr)
+				nodestr = av[i];
+			else
+				usage();
+		}
+		return calibrate(nodestr, set);
+	}
+	if (av[1] && !strcmp(av[1], "-b")) {
+		bulk = 1;
+		av++;
+	}
 	policy = parse_policy(av[1], av[2]);
 
         nodes = nusa_allocate_nodemask();
@@ -39,5 +85,7 @@ int main(int ac, char **av)
 		perror("mbind"), exit(1);
 	stream_init(map);
 	stream_test(NULL);
+	if (bulk)
+		stream_bulk_test(NULL);
 	return 0;
 }
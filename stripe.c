@@ -0,0 +1,193 @@
+/* Striped interleave at chunk granularity.
+
+   libnusa is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; version
+   2.1.
+
+   libnusa is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should find a copy of v2.1 of the GNU Lesser General Public License
+   somewhere on your Linux system; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+   MPOL_INTERLEAVE rotates nodes every page, which breaks every huge
+   page worth of range across nodes. Here each chunk gets a single node
+   policy of its own instead, rotating over the nodes chunk by chunk, so
+   a chunk the size of a huge page can still be backed by one.
+
+   That takes one mbind per run of chunks on the same node, and each
+   run becomes its own VMA. A range that would need more VMAs than
+   vm.max_map_count leaves room for is refused with ENOMEM up front,
+   rather than failing half way with some chunks striped. */
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "nusa.h"
+#include "nusaif.h"
+#include "nusaint.h"
+#include "nusaext.h"
+
+#define STRIPE_CHUNK	(2UL << 20)	/* default, a x86 huge page */
+
+/* VMAs the process may still create, -1 when unknown */
+static long maps_left(void)
+{
+	char *line = NULL;
+	size_t len = 0;
+	long max, used = 0;
+	FILE *f;
+
+	f = fopen("/proc/sys/vm/max_map_count", "r");
+	if (!f)
+		return -1;
+	if (fscanf(f, "%ld", &max) != 1)
+		max = -1;
+	fclose(f);
+	if (max < 0)
+		return -1;
+	f = fopen("/proc/self/maps", "r");
+	if (!f)
+		return -1;
+	while (getdelim(&line, &len, '\n', f) > 0)
+		used++;
+	free(line);
+	fclose(f);
+	return max > used ? max - used : 0;
+}
+
+/* Check that the policy of every chunk came out as asked */
+static int stripe_verify(char *mem, size_t size, size_t chunk, int mode,
+			 const int *node, int w)
+{
+	struct bitmask *got = nusa_allocate_nodemask();
+	unsigned long i, n = (size + chunk - 1) / chunk;
+	int ret = 0, m;
+
+	if (!got)
+		return -1;
+	for (i = 0; i < n && ret == 0; i++) {
+		if (get_prampolicy(&m, got->maskp, got->size + 1,
+				   mem + i * chunk, MPOL_F_ADDR) < 0) {
+			ret = -1;
+		} else if (m != mode || nusa_bitmask_weight(got) != 1 ||
+			   !nusa_bitmask_isbitset(got, node[i % w])) {
+			errno = EIO;
+			ret = -1;
+		}
+	}
+	nusa_bitmask_free(got);
+	return ret;
+}
+
+/* Give [mem, mem + size) to nodes in turn, chunk bytes each, starting
+   with the lowest node. mem must be page aligned, and aligned to chunk
+   for the chunks to line up with huge pages. chunk 0 is 2MB. Pages
+   may go elsewhere when their node is full, unless NUSA_STRIPE_STRICT
+   is set. Returns 0, or -1 with errno set. */
+int nusa_stripe_memory(void *mem, size_t size, struct bitmask *nodes,
+		       size_t chunk, int flags)
+{
+	unsigned long page = getpagesize();
+	int mode = flags & NUSA_STRIPE_STRICT ? MPOL_BIND : MPOL_PREFERRED;
+	unsigned mflags = 0;
+	struct bitmask *one;
+	int *node, w, i;
+	size_t off, run;
+	long left;
+	int ret = -1;
+
+	if (!chunk)
+		chunk = STRIPE_CHUNK;
+	if (((unsigned long)mem & (page - 1)) || (chunk & (page - 1)) ||
+	    !nodes || (flags & ~(NUSA_STRIPE_STRICT | NUSA_STRIPE_MOVE))) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (flags & NUSA_STRIPE_MOVE)
+		mflags |= MPOL_MF_MOVE;
+	if ((flags & NUSA_STRIPE_STRICT) && (flags & NUSA_STRIPE_MOVE))
+		mflags |= MPOL_MF_STRICT;
+
+	w = nusa_bitmask_weight(nodes);
+	if (w == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	node = malloc(w * sizeof(int));
+	one = nusa_allocate_nodemask();
+	if (!node || !one) {
+		errno = ENOMEM;
+		goto out;
+	}
+	for (i = 0, w = 0; (i = nusa_bitmask_next(nodes, i)) >= 0; i++)
+		node[w++] = i;
+
+	/* with a single node all chunks form one run */
+	run = w == 1 ? size : chunk;
+	/* each run may split off a VMA on both sides of it */
+	left = maps_left();
+	if (left >= 0 && (size + run - 1) / run + 2 > (unsigned long)left) {
+		errno = ENOMEM;
+		goto out;
+	}
+	for (off = 0, i = 0; off < size; off += run, i = (i + 1) % w) {
+		size_t len = size - off < run ? size - off : run;
+
+		nusa_bitmask_clearall(one);
+		nusa_bitmask_setbit(one, node[i]);
+		if (mbind((char *)mem + off, len, mode, one->maskp,
+			  one->size + 1, mflags) < 0)
+			goto out;
+	}
+	ret = stripe_verify(mem, size, chunk, mode, node, w);
+out:
+	if (one)
+		nusa_bitmask_free(one);
+	free(node);
+	return ret;
+}
+
+/* Allocate size bytes aligned to chunk and striped over nodes. Free
+   with nusa_free. */
+void *nusa_alloc_striped(size_t size, struct bitmask *nodes, size_t chunk,
+			 int flags)
+{
+	unsigned long page = getpagesize();
+	char *map, *mem;
+	size_t head;
+
+	if (!chunk)
+		chunk = STRIPE_CHUNK;
+	if (!size || (chunk & (page - 1))) {
+		errno = EINVAL;
+		return NULL;
+	}
+	size = (size + page - 1) & ~(page - 1);
+	map = mmap(NULL, size + chunk, PROT_READ|PROT_WRITE,
+		   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+	/* trim to a chunk aligned start */
+	mem = map;
+	if ((chunk & (chunk - 1)) == 0)
+		mem = (char *)(((unsigned long)map + chunk - 1) & ~(chunk - 1));
+	head = mem - map;
+	if (head)
+		munmap(map, head);
+	munmap(mem + size, chunk - head);
+	if (nusa_stripe_memory(mem, size, nodes, chunk, flags) < 0) {
+		int err = errno;
+
+		munmap(mem, size);
+		errno = err;
+		return NULL;
+	}
+	return mem;
+}
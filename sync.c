@@ -0,0 +1,260 @@
+/* Node aware locks and counters.
+
+   libnusa is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; version
+   2.1.
+
+   libnusa is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should find a copy of v2.1 of the GNU Lesser General Public License
+   somewhere on your Linux system; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+   The cohort lock is a ticket lock per node under a global ticket lock.
+   A thread first takes its node's lock, then the global one. On unlock,
+   when another thread of the same node is waiting, the global lock is
+   passed on inside the node instead of being released, up to
+   COHORT_BATCH times in a row. The lock and the data it protects then
+   stay in one node's caches for a batch of critical sections.
+
+   Sharded counters keep one cache line per cpu, grouped per node and
+   allocated on that node. Adding touches only the caller's line, reading
+   sums all of them. */
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nusa.h"
+#include "nusaint.h"
+#include "nusaext.h"
+#include "topology.h"
+
+#define COHORT_BATCH	64	/* local hand overs before letting go */
+#define CACHELINE	64
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield" ::: "memory");
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+struct ticket {
+	unsigned next;
+	unsigned owner;
+};
+
+static inline void ticket_lock(struct ticket *t)
+{
+	unsigned me = __atomic_fetch_add(&t->next, 1, __ATOMIC_RELAXED);
+
+	while (__atomic_load_n(&t->owner, __ATOMIC_ACQUIRE) != me)
+		cpu_relax();
+}
+
+static inline void ticket_unlock(struct ticket *t)
+{
+	__atomic_store_n(&t->owner, t->owner + 1, __ATOMIC_RELEASE);
+}
+
+static inline int ticket_waiters(struct ticket *t)
+{
+	return __atomic_load_n(&t->next, __ATOMIC_RELAXED) - t->owner > 1;
+}
+
+struct cohort_node {
+	struct ticket local;
+	int global_held;	/* the global lock was passed to us */
+	int batch;		/* hand overs in a row */
+} __attribute__((aligned(CACHELINE)));
+
+struct nusa_cohort_lock {
+	struct ticket global;
+	int owner_node;		/* node of the holder, for unlock */
+	int nnodes;
+	const int *cpu_node;
+	int ncpus;
+	struct cohort_node *node;
+} __attribute__((aligned(CACHELINE)));
+
+struct nusa_cohort_lock *nusa_cohort_lock_create(void)
+{
+	struct nusa_cohort_lock *l;
+
+	if (posix_memalign((void **)&l, CACHELINE, sizeof(*l)))
+		return NULL;
+	memset(l, 0, sizeof(*l));
+	l->nnodes = nusa_max_node() + 1;
+	l->cpu_node = topo_cpu_node_table();
+	l->ncpus = topo_num_cpus();
+	if (posix_memalign((void **)&l->node, CACHELINE,
+			   l->nnodes * sizeof(struct cohort_node))) {
+		free(l);
+		return NULL;
+	}
+	memset(l->node, 0, l->nnodes * sizeof(struct cohort_node));
+	return l;
+}
+
+void nusa_cohort_lock(struct nusa_cohort_lock *l)
+{
+	int cpu = current_cpu();
+	int node = 0;
+	struct cohort_node *n;
+
+	if (l->cpu_node && (unsigned)cpu < (unsigned)l->ncpus &&
+	    l->cpu_node[cpu] >= 0)
+		node = l->cpu_node[cpu];
+	n = &l->node[node];
+	ticket_lock(&n->local);
+	if (!n->global_held)
+		ticket_lock(&l->global);
+	l->owner_node = node;
+}
+
+void nusa_cohort_unlock(struct nusa_cohort_lock *l)
+{
+	struct cohort_node *n = &l->node[l->owner_node];
+
+	if (ticket_waiters(&n->local) && n->batch < COHORT_BATCH) {
+		n->global_held = 1;
+		n->batch++;
+	} else {
+		n->global_held = 0;
+		n->batch = 0;
+		ticket_unlock(&l->global);
+	}
+	ticket_unlock(&n->local);
+}
+
+void nusa_cohort_lock_destroy(struct nusa_cohort_lock *l)
+{
+	if (!l)
+		return;
+	free(l->node);
+	free(l);
+}
+
+struct counter_slot {
+	long val;
+} __attribute__((aligned(CACHELINE)));
+
+struct nusa_counter {
+	int ncpus;
+	int nnodes;
+	struct counter_slot **slot;	/* per cpu */
+	struct counter_slot **node_slots; /* per node block */
+	int *node_ncpus;
+	size_t *node_bytes;
+	struct counter_slot spare;	/* cpus without a node */
+};
+
+struct nusa_counter *nusa_counter_create(void)
+{
+	const int *cpu_node = topo_cpu_node_table();
+	struct nusa_counter *c;
+	int cpu, node;
+
+	if (!cpu_node) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (posix_memalign((void **)&c, CACHELINE, sizeof(*c)))
+		return NULL;
+	memset(c, 0, sizeof(*c));
+	c->ncpus = topo_num_cpus();
+	c->nnodes = nusa_max_node() + 1;
+	c->slot = calloc(c->ncpus, sizeof(struct counter_slot *));
+	c->node_slots = calloc(c->nnodes, sizeof(struct counter_slot *));
+	c->node_ncpus = calloc(c->nnodes, sizeof(int));
+	c->node_bytes = calloc(c->nnodes, sizeof(size_t));
+	if (!c->slot || !c->node_slots || !c->node_ncpus || !c->node_bytes)
+		goto fail;
+	for (cpu = 0; cpu < c->ncpus; cpu++)
+		if (cpu_node[cpu] >= 0 && cpu_node[cpu] < c->nnodes)
+			c->node_ncpus[cpu_node[cpu]]++;
+	for (node = 0; node < c->nnodes; node++) {
+		if (!c->node_ncpus[node])
+			continue;
+		c->node_bytes[node] = c->node_ncpus[node] *
+				      sizeof(struct counter_slot);
+		/* memoryless nodes get their lines from the default policy */
+		if (nusa_bitmask_isbitset(nusa_all_nodes_ptr, node))
+			c->node_slots[node] = nusa_alloc_onnode(c->node_bytes[node],
+								node);
+		else
+			c->node_slots[node] = nusa_alloc(c->node_bytes[node]);
+		if (!c->node_slots[node])
+			goto fail;
+		memset(c->node_slots[node], 0, c->node_bytes[node]);
+	}
+	memset(c->node_ncpus, 0, c->nnodes * sizeof(int));
+	for (cpu = 0; cpu < c->ncpus; cpu++) {
+		node = cpu_node[cpu];
+		if (node < 0 || node >= c->nnodes)
+			c->slot[cpu] = &c->spare;
+		else
+			c->slot[cpu] = &c->node_slots[node][c->node_ncpus[node]++];
+	}
+	return c;
+fail:
+	nusa_counter_destroy(c);
+	errno = ENOMEM;
+	return NULL;
+}
+
+void nusa_counter_add(struct nusa_counter *c, long val)
+{
+	int cpu = current_cpu();
+	struct counter_slot *s;
+
+	s = (unsigned)cpu < (unsigned)c->ncpus ? c->slot[cpu] : &c->spare;
+	/* atomic because a thread can move cpus between reading the cpu
+	   and the add; uncontended it costs about as much as a plain add */
+	__atomic_fetch_add(&s->val, val, __ATOMIC_RELAXED);
+}
+
+/* Sum of the counter over the cpus of node, -1 for all cpus */
+long nusa_counter_read(struct nusa_counter *c, int node)
+{
+	long sum = 0;
+	int i, n;
+
+	if (node < 0) {
+		for (n = 0; n < c->nnodes; n++)
+			sum += nusa_counter_read(c, n);
+		return sum + __atomic_load_n(&c->spare.val, __ATOMIC_RELAXED);
+	}
+	if (node >= c->nnodes || !c->node_slots[node])
+		return 0;
+	for (i = 0; i < c->node_ncpus[node]; i++)
+		sum += __atomic_load_n(&c->node_slots[node][i].val,
+				       __ATOMIC_RELAXED);
+	return sum;
+}
+
+void nusa_counter_destroy(struct nusa_counter *c)
+{
+	int node;
+
+	if (!c)
+		return;
+	if (c->node_slots)
+		for (node = 0; node < c->nnodes; node++)
+			if (c->node_slots[node])
+				nusa_free(c->node_slots[node],
+					  c->node_bytes[node]);
+	free(c->slot);
+	free(c->node_slots);
+	free(c->node_ncpus);
+	free(c->node_bytes);
+	free(c);
+}
@@ -13,13 +13,30 @@
    You should find a copy of v2.1 of the GNU Lesser General Public License
    somewhere on your Linux system; if not, write to the Free Software
    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA */
+#define _GNU_SOURCE 1
 #include <unistd.h>
+#include <sched.h>
 #include <sys/types.h>
 #include <asm/unistd.h>
 #include <errno.h>
 #include "nusa.h"
 #include "nusaif.h"
+#include "nusaext.h"
+#include "nusainline.h"
 #include "nusaint.h"
+#include "topology.h"
+
+/* glibc 2.35 and later registers an rseq area for each thread, which
+   the kernel keeps updated with the current cpu. Reading it needs the
+   thread pointer builtin. */
+#if defined(__has_include)
+#if __has_include(<sys/rseq.h>) && __GNUC__ >= 11 && \
+    (defined(__x86_64__) || defined(__aarch64__) || defined(__powerpc64__) || \
+     defined(__s390x__) || defined(__riscv))
+#include <sys/rseq.h>
+#define HAVE_RSEQ_AREA 1
+#endif
+#endif
 
 #define WEAK __attribute__((weak))
 
@@ -264,3 +281,32 @@ make_internal_alias(nusa_sched_getaffinity_v1);
 make_internal_alias(nusa_sched_getaffinity_v2);
 make_internal_alias(nusa_sched_setaffinity_v1);
 make_internal_alias(nusa_sched_setaffinity_v2);
+
+/* Current cpu from the rseq area without a system call, falling back
+   to sched_getcpu (vDSO) when rseq is not registered. */
+hidden int current_cpu(void)
+{
+#ifdef HAVE_RSEQ_AREA
+	if (__rseq_size) {
+		const struct rseq *rs = (const struct rseq *)
+			((char *)__builtin_thread_pointer() + __rseq_offset);
+		/* -1 before and -2 after a failed registration */
+		int cpu = (int)__atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED);
+		if (cpu >= 0)
+			return cpu;
+	}
+#endif
+	return sched_getcpu();
+}
+
+/* Return the node of the cpu the caller is running on, -1 on error.
+   The answer can be stale as soon as it is returned when the thread is
+   not bound to a node. */
+int nusa_current_node(void)
+{
+	int cpu = current_cpu();
+
+	if (cpu < 0)
+		return -1;
+	return nusa_node_of_cpu_fast(cpu);
+}
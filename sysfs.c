@@ -3,31 +3,166 @@
 #include <stdio.h>
 #include <sys/fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/stat.h>
 #include "nusa.h"
 #include "nusaint.h"
+#include "sysfs.h"
+#include "bitmask.h"
 
-#define SYSFS_BLOCK 4096
+static const char *sysfs_dir_names[SYSFS_NDIRS] = {
+	[SYSFS_NODE_DIR] = "/sys/devices/system/node",
+	[SYSFS_CPU_DIR] = "/sys/devices/system/cpu",
+};
+static int sysfs_dir_fds[SYSFS_NDIRS] = { -1, -1 };
+static pthread_once_t sysfs_dir_once = PTHREAD_ONCE_INIT;
+
+static void open_sysfs_dirs(void)
+{
+	int i;
+	for (i = 0; i < SYSFS_NDIRS; i++)
+		sysfs_dir_fds[i] = open(sysfs_dir_names[i],
+					O_PATH|O_DIRECTORY|O_CLOEXEC);
+}
+
+/* Return a cached directory fd for one of the sysfs topology
+   directories, or AT_FDCWD when it cannot be opened. */
+hidden int sysfs_dir(int dir)
+{
+	pthread_once(&sysfs_dir_once, open_sysfs_dirs);
+	if (dir < 0 || dir >= SYSFS_NDIRS || sysfs_dir_fds[dir] < 0)
+		return AT_FDCWD;
+	return sysfs_dir_fds[dir];
+}
+
+/* Read a sysfs attribute relative to dirfd into buf and zero terminate
+   it. Returns the length read or -1 with errno set. No allocation. */
+hidden int sysfs_read_at(int dirfd, const char *name, char *buf, int len)
+{
+	int fd, n;
+
+	fd = openat(dirfd, name, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	/* sysfs attributes are at most a page and come in one read */
+	n = pread(fd, buf, len - 1, 0);
+	close(fd);
+	if (n < 0)
+		return -1;
+	buf[n] = 0;
+	return n;
+}
+
+/* Open directory dir again and replace the cached fd old with it when
+   old no longer refers to it: closed, reused by the program, or left
+   behind by a remount of sysfs. Returns the new fd, or -1 with errno
+   unchanged when old is still good. The old fd may be in use by other
+   threads, so it is not closed. */
+static int sysfs_reopen_dir(int dir, int old)
+{
+	struct stat a, b;
+	int err = errno;
+	int fd;
+
+	fd = open(sysfs_dir_names[dir], O_PATH|O_DIRECTORY|O_CLOEXEC);
+	if (fd < 0)
+		goto out;
+	/* old was closed and its number came back: the cache is right */
+	if (fd == old)
+		return fd;
+	if (fstat(old, &a) == 0 && fstat(fd, &b) == 0 &&
+	    a.st_dev == b.st_dev && a.st_ino == b.st_ino) {
+		close(fd);
+		goto out;
+	}
+	if (!__atomic_compare_exchange_n(&sysfs_dir_fds[dir], &old, fd, 0,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		/* another thread was first */
+		close(fd);
+		return old;
+	}
+	return fd;
+out:
+	errno = err;
+	return -1;
+}
+
+/* Read attribute name in one of the sysfs topology directories. When
+   the read through the cached directory fd fails with an error that
+   means the fd itself is bad (closed or reused by the program, or left
+   behind by a remount), the directory is opened again once and the read
+   retried. Other errors, ENOENT for a missing attribute above all, are
+   returned as they are. */
+hidden int sysfs_read_dir(int dir, const char *name, char *buf, int len)
+{
+	char path[PATH_MAX];
+	int dirfd = sysfs_dir(dir);
+	int n;
+
+	if (dirfd != AT_FDCWD) {
+		n = sysfs_read_at(dirfd, name, buf, len);
+		if (n >= 0)
+			return n;
+		if (errno != EBADF && errno != ENOTDIR && errno != ENODEV &&
+		    errno != ESTALE)
+			return -1;
+		dirfd = sysfs_reopen_dir(dir, dirfd);
+		if (dirfd < 0)
+			return -1;
+		return sysfs_read_at(dirfd, name, buf, len);
+	}
+	if (dir < 0 || dir >= SYSFS_NDIRS) {
+		errno = EINVAL;
+		return -1;
+	}
+	snprintf(path, sizeof path, "%s/%s", sysfs_dir_names[dir], name);
+	return sysfs_read_at(AT_FDCWD, path, buf, len);
+}
+
+/* Read a batch of attributes into the caller's buffers. The result of
+   each read is in attr->ret. Returns the number of successful reads.
+   This is a plain loop of one open and one read per attribute, not
+   batched I/O: sysfs reads are synchronous in the kernel and there is
+   nothing to overlap. The saving is the lookups done relative to the
+   cached directory fds, instead of from the root for every file. */
+hidden int sysfs_read_batch(struct sysfs_attr *attrs, int n)
+{
+	int i, ok = 0;
+
+	for (i = 0; i < n; i++) {
+		struct sysfs_attr *a = &attrs[i];
+
+		if (a->dir >= 0)
+			a->ret = sysfs_read_dir(a->dir, a->name, a->buf, a->len);
+		else
+			a->ret = sysfs_read_at(AT_FDCWD, a->name, a->buf, a->len);
+		if (a->ret < 0)
+			a->ret = -errno;
+		else
+			ok++;
+	}
+	return ok;
+}
 
 hidden char *sysfs_read(char *name)
 {
 	char *buf;
 	int n;
-	int fd;
 
-	fd = open(name, O_RDONLY);
 	buf = malloc(SYSFS_BLOCK);
 	if (!buf)
 		return NULL;
-	n = read(fd, buf, SYSFS_BLOCK - 1);
-	close(fd);
+	n = sysfs_read_at(AT_FDCWD, name, buf, SYSFS_BLOCK);
 	if (n <= 0) {
 		free(buf);
 		return NULL;
 	}
-	buf[n] = 0;
 	return buf;
 }
 
@@ -35,35 +170,24 @@ hidden int sysfs_node_read(struct bitmask *mask, char *fmt, ...)
 {
 	int n;
 	va_list ap;
-	char *p, *fn, *m, *end;
-	int num;
+	char fn[PATH_MAX], buf[SYSFS_BLOCK];
+	char *m;
 
 	va_start(ap, fmt);
-	n = vasprintf(&fn, fmt, ap);
+	n = vsnprintf(fn, sizeof fn, fmt, ap);
 	va_end(ap);
-	if (n < 0)
+	if (n < 0 || n >= sizeof fn)
 		return -1;
-	p = sysfs_read(fn);
-	free(fn);
-	if (!p)
+	if (sysfs_read_at(AT_FDCWD, fn, buf, sizeof buf) <= 0)
 		return -1;
 
-	m = p;
-	do {
-		num = strtol(m, &end, 0);
-		if (m == end)
-			return -1;
-		if (num < 0)
-			return -2;
-		if (num >= nusa_num_task_nodes())
-			return -1;
-		nusa_bitmask_setbit(mask, num);
-
-		/* Continuation not supported by kernel yet. */
-		m = end;
-		while (isspace(*m) || *m == ',')
-			m++;
-	} while (isdigit(*m));
-	free(p);
+	m = buf;
+	while (isspace(*m))
+		m++;
+	/* -1: the kernel does not know the node */
+	if (*m == '-')
+		return -2;
+	if (bitmask_parse_list(m, mask) < 0)
+		return -1;
 	return 0;
 }
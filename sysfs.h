@@ -1,3 +1,24 @@
 struct bitmask;
+
+#define SYSFS_BLOCK 4096	/* sysfs attributes are at most a page */
+
+enum {
+	SYSFS_NODE_DIR,		/* /sys/devices/system/node */
+	SYSFS_CPU_DIR,		/* /sys/devices/system/cpu */
+	SYSFS_NDIRS
+};
+
+struct sysfs_attr {
+	int dir;		/* SYSFS_*_DIR, or -1 for an absolute name */
+	const char *name;
+	char *buf;
+	int len;		/* size of buf */
+	int ret;		/* length read or -errno */
+};
+
 hidden char *sysfs_read(char *name);
 hidden int sysfs_node_read(struct bitmask *mask, char *fmt, ...);
+hidden int sysfs_dir(int dir);
+hidden int sysfs_read_at(int dirfd, const char *name, char *buf, int len);
+hidden int sysfs_read_dir(int dir, const char *name, char *buf, int len);
+hidden int sysfs_read_batch(struct sysfs_attr *attrs, int n);
@@ -0,0 +1,93 @@
+/* Test node local arenas: objects from several threads, cross thread
+   frees and placement on the arena's node. */
+#include <nusa.h>
+#include <nusaif.h>
+#include <nusaext.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define err(x) perror(x),exit(1)
+
+enum {
+	NTHREADS = 4,
+	NOBJS = 20000,
+};
+
+static struct nusa_arena *arena;
+static void *objs[NTHREADS][NOBJS];
+
+static void *worker(void *arg)
+{
+	long t = (long)arg;
+	int i;
+
+	for (i = 0; i < NOBJS; i++) {
+		size_t size = 1 + (i * 37 + t) % NUSA_ARENA_MAX_SIZE;
+		void *p = nusa_arena_alloc(arena, size);
+
+		if (!p)
+			err("nusa_arena_alloc");
+		memset(p, t + 1, size);
+		__atomic_store_n(&objs[t][i], p, __ATOMIC_RELEASE);
+	}
+	/* free half of the objects of the next thread */
+	for (i = 0; i < NOBJS; i += 2) {
+		long o = (t + 1) % NTHREADS;
+		size_t size = 1 + (i * 37 + o) % NUSA_ARENA_MAX_SIZE;
+
+		while (!__atomic_load_n(&objs[o][NOBJS - 1], __ATOMIC_ACQUIRE))
+			;
+		if (((unsigned char *)objs[o][i])[size - 1] != o + 1) {
+			printf("object %ld/%d overwritten\n", o, i);
+			exit(1);
+		}
+		nusa_arena_free(arena, objs[o][i]);
+	}
+	return NULL;
+}
+
+int main(void)
+{
+	pthread_t threads[NTHREADS];
+	int node, status, ret = 0;
+	long t;
+	void *p;
+
+	if (nusa_available() < 0) {
+		printf("no NUMA API available\n");
+		exit(1);
+	}
+	node = nusa_max_node();
+	while (node > 0 && !nusa_bitmask_isbitset(nusa_all_nodes_ptr, node))
+		node--;
+	arena = nusa_arena_create_onnode(node);
+	if (!arena)
+		err("nusa_arena_create_onnode");
+
+	for (t = 0; t < NTHREADS; t++)
+		pthread_create(&threads[t], NULL, worker, (void *)t);
+	for (t = 0; t < NTHREADS; t++)
+		pthread_join(threads[t], NULL);
+
+	for (t = 0; t < NTHREADS; t++) {
+		p = objs[t][NOBJS - 1];
+		if (move_pages(0, 1, &p, NULL, &status, 0) < 0)
+			err("move_pages");
+		if (status != node) {
+			printf("object on node %d, expected %d\n", status, node);
+			ret = 1;
+		}
+	}
+
+	if (nusa_arena_alloc(arena, NUSA_ARENA_MAX_SIZE + 1) != NULL) {
+		printf("oversized allocation succeeded\n");
+		ret = 1;
+	}
+	nusa_arena_destroy(arena);
+	if (!ret)
+		printf("Passed\n");
+	return ret;
+}
@@ -0,0 +1,308 @@
+/* Contention scaling of a shared cache line. Threads are added first
+   on the cpus of one node, then node by node in distance order. Each
+   run does atomic increments, compare and swap loops or mutex lock and
+   unlock on one line, placed with mbind on the writers' first node
+   (local) and on the node farthest from it (remote). Reports ops/s
+   and percentiles of the time per operation.
+
+   atomicbench [-t seconds] [-n node of the writers] */
+#define _GNU_SOURCE 1
+#include <nusa.h>
+#include <nusaif.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define err(x) perror(x),exit(1)
+
+enum { INC, CAS, MUTEX, NOPS };
+static const char *op_name[NOPS] = { "atomic inc", "cas loop", "mutex" };
+
+#define SAMPLE_EVERY	16	/* time one op out of this many */
+#define MAX_SAMPLES	(1 << 16)
+
+struct shared {
+	long counter;
+	char pad[64 - sizeof(long)];
+	pthread_mutex_t mutex;
+};
+
+struct worker {
+	pthread_t thread;
+	int cpu;
+	long ops;
+	int nsamples;
+	float *samples;
+} __attribute__((aligned(64)));
+
+static struct shared *line;
+static int op, stop;
+static pthread_barrier_t barrier;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static inline void do_op(void)
+{
+	long old;
+
+	switch (op) {
+	case INC:
+		__atomic_fetch_add(&line->counter, 1, __ATOMIC_RELAXED);
+		break;
+	case CAS:
+		old = __atomic_load_n(&line->counter, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&line->counter, &old,
+				old + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			;
+		break;
+	case MUTEX:
+		pthread_mutex_lock(&line->mutex);
+		line->counter++;
+		pthread_mutex_unlock(&line->mutex);
+		break;
+	}
+}
+
+static void *run(void *arg)
+{
+	struct worker *w = arg;
+	cpu_set_t set;
+	long ops = 0;
+
+	CPU_ZERO(&set);
+	CPU_SET(w->cpu, &set);
+	sched_setaffinity(0, sizeof set, &set);
+	w->nsamples = 0;
+	pthread_barrier_wait(&barrier);
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		if (ops % SAMPLE_EVERY == 0 && w->nsamples < MAX_SAMPLES) {
+			double t = now();
+
+			do_op();
+			w->samples[w->nsamples++] = now() - t;
+		} else {
+			do_op();
+		}
+		ops++;
+	}
+	w->ops = ops;
+	return NULL;
+}
+
+static int cmp_float(const void *a, const void *b)
+{
+	float x = *(const float *)a, y = *(const float *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Double the threads up to the first node's cpus, then add a node */
+static int next_count(int n, int *cpunode, int ncpus)
+{
+	int first = 1;
+
+	while (first < ncpus && cpunode[first] == cpunode[0])
+		first++;
+	if (n < first)
+		return n * 2 < first ? n * 2 : first;
+	if (n >= ncpus)
+		return ncpus + 1;
+	while (n < ncpus && cpunode[n] == cpunode[n - 1])
+		n++;
+	n++;
+	while (n < ncpus && cpunode[n] == cpunode[n - 1])
+		n++;
+	return n;
+}
+
+static struct shared *place_line(int node)
+{
+	struct bitmask *mask = nusa_allocate_nodemask();
+	long pagesz = getpagesize();
+	struct shared *s;
+	int status;
+	void *p;
+
+	p = mmap(NULL, pagesz, PROT_READ|PROT_WRITE,
+		 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		err("mmap");
+	nusa_bitmask_setbit(mask, node);
+	if (mbind(p, pagesz, MPOL_BIND, mask->maskp, mask->size + 1,
+		  MPOL_MF_MOVE) < 0)
+		err("mbind");
+	nusa_bitmask_free(mask);
+	s = p;
+	memset(s, 0, sizeof(*s));
+	pthread_mutex_init(&s->mutex, NULL);
+	if (move_pages(0, 1, &p, NULL, &status, 0) == 0 && status != node)
+		printf("warning: line on node %d instead of %d\n",
+		       status, node);
+	return s;
+}
+
+/* Distance of node n from home, 0 when n has no memory. Without a
+   distance table home comes first, then the other nodes in order. */
+static int node_distance(int home, int n)
+{
+	if (nusa_distance(home, home) > 0)
+		return nusa_distance(home, n);
+	if (!nusa_bitmask_isbitset(nusa_nodes_ptr, n))
+		return 0;
+	return n == home ? 1 : 2 + n;
+}
+
+int main(int ac, char **av)
+{
+	double secs = 0.2, noise;
+	int home = -1, remote, c, i, k, n, ncpus = 0, nthreads;
+	struct bitmask *cpus;
+	struct worker *w;
+	int *cpulist, *cpunode;
+	float *all = NULL;
+	long nall = 0;
+
+	while ((c = getopt(ac, av, "t:n:")) != -1) {
+		switch (c) {
+		case 't':
+			secs = atof(optarg);
+			break;
+		case 'n':
+			home = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: atomicbench [-t seconds] [-n node]\n");
+			exit(1);
+		}
+	}
+	if (nusa_available() < 0) {
+		printf("no NUMA API available\n");
+		exit(1);
+	}
+	cpus = nusa_allocate_cpumask();
+	if (home < 0)
+		home = nusa_node_of_cpu(0) >= 0 ? nusa_node_of_cpu(0) : 0;
+	cpulist = malloc(cpus->size * sizeof(int));
+	cpunode = malloc(cpus->size * sizeof(int));
+	w = calloc(cpus->size, sizeof(struct worker));
+	if (!cpulist || !cpunode || !w)
+		err("malloc");
+
+	/* cpus of the home node first, then the other nodes by distance */
+	remote = home;
+	for (k = 0; k <= nusa_max_node(); k++) {
+		int best = -1;
+
+		/* the nearest node to home not used yet */
+		for (n = 0; n <= nusa_max_node(); n++) {
+			int d = node_distance(home, n), j, used = 0;
+
+			if (d <= 0)
+				continue;
+			for (j = 0; j < ncpus && !used; j++)
+				used = cpunode[j] == n;
+			if (used || nusa_node_to_cpus(n, cpus) < 0 ||
+			    nusa_bitmask_weight(cpus) == 0)
+				continue;
+			if (best < 0 || d < node_distance(home, best))
+				best = n;
+		}
+		if (best < 0)
+			break;
+		nusa_node_to_cpus(best, cpus);
+		for (i = 0; i < cpus->size; i++)
+			if (nusa_bitmask_isbitset(cpus, i)) {
+				cpunode[ncpus] = best;
+				cpulist[ncpus++] = i;
+			}
+	}
+	if (!ncpus)
+		err("no cpus");
+	/* farthest node with memory from the writers' node */
+	for (n = 0; n <= nusa_max_node(); n++)
+		if (nusa_bitmask_isbitset(nusa_all_nodes_ptr, n) &&
+		    node_distance(home, n) > node_distance(home, remote))
+			remote = n;
+
+	for (i = 0; i < ncpus; i++)
+		if (!(w[i].samples = malloc(MAX_SAMPLES * sizeof(float))))
+			err("malloc");
+
+	/* cost of the timer itself, taken off the samples */
+	noise = now();
+	for (i = 0; i < 1000; i++)
+		now();
+	noise = (now() - noise) / 1000;
+
+	printf("writers from node %d, remote line on node %d, timer %.0fns\n",
+	       home, remote, noise);
+	printf("%-10s %-7s %-7s %-7s %12s %8s %8s %8s\n", "op", "line",
+	       "threads", "nodes", "Mops/s", "p50 ns", "p99 ns", "p99.9 ns");
+	for (op = 0; op < NOPS; op++)
+	for (k = 0; k < 2; k++) {
+		int node = k ? remote : home;
+
+		if (k && remote == home)
+			break;
+		line = place_line(node);
+		for (nthreads = 1; nthreads <= ncpus;
+		     nthreads = next_count(nthreads, cpunode, ncpus)) {
+			struct timespec ts = {
+				(time_t)secs, (long)((secs - (time_t)secs) * 1e9)
+			};
+			long total = 0, ns = 0;
+			int nodes = 1;
+
+			for (i = 1; i < nthreads; i++)
+				nodes += cpunode[i] != cpunode[i - 1];
+			stop = 0;
+			pthread_barrier_init(&barrier, NULL, nthreads + 1);
+			for (i = 0; i < nthreads; i++) {
+				w[i].cpu = cpulist[i];
+				pthread_create(&w[i].thread, NULL, run, &w[i]);
+			}
+			pthread_barrier_wait(&barrier);
+			nanosleep(&ts, NULL);
+			__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+			for (i = 0; i < nthreads; i++) {
+				pthread_join(w[i].thread, NULL);
+				total += w[i].ops;
+				ns += w[i].nsamples;
+			}
+			/* only as large as the samples actually taken */
+			if (ns > nall) {
+				all = realloc(all, ns * sizeof(float));
+				if (!all)
+					err("realloc");
+				nall = ns;
+			}
+			for (i = 0, ns = 0; i < nthreads; i++) {
+				memcpy(all + ns, w[i].samples,
+				       w[i].nsamples * sizeof(float));
+				ns += w[i].nsamples;
+			}
+			pthread_barrier_destroy(&barrier);
+			qsort(all, ns, sizeof(float), cmp_float);
+			printf("%-10s %-7s %-7d %-7d %12.2f %8.0f %8.0f %8.0f\n",
+			       op_name[op], k ? "remote" : "local", nthreads,
+			       nodes, total / secs / 1e6,
+			       ns ? all[ns / 2] - noise : 0,
+			       ns ? all[ns * 99 / 100] - noise : 0,
+			       ns ? all[ns * 999 / 1000] - noise : 0);
+		}
+		pthread_mutex_destroy(&line->mutex);
+		munmap(line, getpagesize());
+	}
+	return 0;
+}
@@ -0,0 +1,170 @@
+/* Unit test range list and hex mask parsers and the word level operations */
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include "nusa.h"
+#include "nusaext.h"
+#include "nusaint.h"
+#include "bitmask.h"
+
+#define MASKSIZE 4096
+
+/* Format mask like /proc/self/status */
+static void format_hex(char *buf, struct bitmask *mask)
+{
+	int g, b, len = 0;
+
+	for (g = MASKSIZE / 32 - 1; g >= 0; g--) {
+		unsigned v = 0;
+		for (b = 0; b < 32; b++)
+			if (nusa_bitmask_isbitset(mask, g * 32 + b))
+				v |= 1U << b;
+		len += sprintf(buf + len, "%s%08x", len ? "," : "", v);
+	}
+	strcpy(buf + len, "\n");
+}
+
+/* Format mask like a sysfs cpulist */
+static void format_list(char *buf, struct bitmask *mask)
+{
+	int i, j, len = 0;
+
+	for (i = 0; i < MASKSIZE; i = j + 1) {
+		j = i;
+		if (!nusa_bitmask_isbitset(mask, i))
+			continue;
+		while (j + 1 < MASKSIZE && nusa_bitmask_isbitset(mask, j + 1))
+			j++;
+		len += sprintf(buf + len, "%s%d", len ? "," : "", i);
+		if (j > i)
+			len += sprintf(buf + len, "-%d", j);
+	}
+	strcpy(buf + len, "\n");
+}
+
+int main(void)
+{
+	char buf[16384];
+	char buf2[16384];
+	struct bitmask *mask, *mask2, *mask3, *small;
+	int i, j, k;
+
+	mask  = nusa_bitmask_alloc(MASKSIZE);
+	mask2 = nusa_bitmask_alloc(MASKSIZE);
+	mask3 = nusa_bitmask_alloc(MASKSIZE);
+	small = nusa_bitmask_alloc(100);
+
+	printf("Testing bitmap parsers\n");
+	srand(1);
+	for (k = 0; k < 1000; k++) {
+		nusa_bitmask_clearall(mask);
+		for (i = 0; i < MASKSIZE; i++)
+			if (rand() % (k % 7 + 2) == 0)
+				nusa_bitmask_setbit(mask, i);
+
+		format_hex(buf, mask);
+		nusa_bitmask_clearall(mask2);
+		assert(bitmask_parse_hex(buf, mask2) == 0);
+		assert(nusa_bitmask_equal(mask, mask2));
+
+		format_list(buf, mask);
+		nusa_bitmask_clearall(mask2);
+		assert(bitmask_parse_list(buf, mask2) == 0);
+		assert(nusa_bitmask_equal(mask, mask2));
+
+		/* format_list must agree with the bit by bit formatter */
+		buf[strlen(buf) - 1] = 0;
+		assert(nusa_bitmask_format_list(mask, buf2, sizeof(buf2)) ==
+		       (int)strlen(buf));
+		assert(!strcmp(buf, buf2));
+
+		/* next/prev against a plain scan */
+		j = -1;
+		for (i = nusa_bitmask_next(mask, 0); i >= 0;
+		     i = nusa_bitmask_next(mask, i + 1)) {
+			assert(nusa_bitmask_isbitset(mask, i));
+			assert(nusa_bitmask_prev(mask, i) == i);
+			if (i > 0)
+				assert(nusa_bitmask_prev(mask, i - 1) == j);
+			while (++j < i)
+				assert(!nusa_bitmask_isbitset(mask, j));
+		}
+		while (++j < MASKSIZE)
+			assert(!nusa_bitmask_isbitset(mask, j));
+
+		/* set operations against bit by bit results */
+		nusa_bitmask_clearall(mask2);
+		for (i = 0; i < MASKSIZE; i++)
+			if (rand() % 3 == 0)
+				nusa_bitmask_setbit(mask2, i);
+		nusa_bitmask_and(mask3, mask, mask2);
+		for (i = 0; i < MASKSIZE; i++)
+			assert(nusa_bitmask_isbitset(mask3, i) ==
+			       (nusa_bitmask_isbitset(mask, i) &&
+				nusa_bitmask_isbitset(mask2, i)));
+		nusa_bitmask_or(mask3, mask, mask2);
+		for (i = 0; i < MASKSIZE; i++)
+			assert(nusa_bitmask_isbitset(mask3, i) ==
+			       (nusa_bitmask_isbitset(mask, i) ||
+				nusa_bitmask_isbitset(mask2, i)));
+		nusa_bitmask_andnot(mask3, mask, mask2);
+		for (i = 0; i < MASKSIZE; i++)
+			assert(nusa_bitmask_isbitset(mask3, i) ==
+			       (nusa_bitmask_isbitset(mask, i) &&
+				!nusa_bitmask_isbitset(mask2, i)));
+	}
+
+	/* mixed sizes: small masks read as zero beyond their end */
+	nusa_bitmask_setall(mask);
+	nusa_bitmask_clearall(small);
+	nusa_bitmask_setbit(small, 99);
+	nusa_bitmask_and(mask3, mask, small);
+	assert(nusa_bitmask_weight(mask3) == 1);
+	nusa_bitmask_or(small, small, mask);
+	assert(nusa_bitmask_weight(small) == 100);
+	assert(nusa_bitmask_next(small, 100) < 0);
+	assert(nusa_bitmask_prev(small, 5000) == 99);
+
+	nusa_bitmask_clearall(mask);
+	assert(nusa_bitmask_setrange(mask, 3, 200) == mask);
+	assert(nusa_bitmask_setrange(mask, 5, 4) == NULL);
+	assert(nusa_bitmask_setrange(mask, 0, MASKSIZE) == NULL);
+	assert(nusa_bitmask_format_list(mask, buf, sizeof(buf)) == 5);
+	assert(!strcmp(buf, "3-200"));
+	assert(nusa_bitmask_format_list(mask, buf, 3) == 5);
+	assert(!strcmp(buf, "3-"));
+	nusa_bitmask_clearall(mask);
+	assert(nusa_bitmask_format_list(mask, buf, sizeof(buf)) == 0);
+	assert(buf[0] == 0 && nusa_bitmask_next(mask, 0) < 0);
+
+	nusa_bitmask_clearall(mask);
+	assert(bitmask_parse_list("0-63,128-191\n", mask) == 0);
+	assert(nusa_bitmask_weight(mask) == 128);
+	assert(nusa_bitmask_isbitset(mask, 128) && !nusa_bitmask_isbitset(mask, 64));
+	nusa_bitmask_clearall(mask);
+	assert(bitmask_parse_hex("f,00000000,00000001", mask) == 0);
+	assert(nusa_bitmask_weight(mask) == 5);
+	assert(nusa_bitmask_isbitset(mask, 0) && nusa_bitmask_isbitset(mask, 67));
+
+	nusa_bitmask_clearall(mask);
+	assert(bitmask_parse_hex("1,ff", mask) == 0);
+	assert(nusa_bitmask_weight(mask) == 9);
+	assert(nusa_bitmask_isbitset(mask, 7) && nusa_bitmask_isbitset(mask, 32));
+	assert(!nusa_bitmask_isbitset(mask, 8));
+	nusa_bitmask_clearall(mask);
+	assert(bitmask_parse_hex("ff,1", mask) == 0);
+	assert(nusa_bitmask_weight(mask) == 9);
+	assert(nusa_bitmask_isbitset(mask, 0) && !nusa_bitmask_isbitset(mask, 4));
+	assert(nusa_bitmask_isbitset(mask, 32) && nusa_bitmask_isbitset(mask, 39));
+
+	assert(bitmask_parse_list("5-3", mask) < 0);
+	assert(bitmask_parse_list("4096", mask) < 0);
+	assert(bitmask_parse_list("1,,2", mask) < 0);
+	assert(bitmask_parse_hex(",ff", mask) < 0);
+	assert(bitmask_parse_hex("ff,", mask) < 0);
+	assert(bitmask_parse_hex("fg", mask) < 0);
+	printf("Passed\n");
+	return 0;
+}
@@ -0,0 +1,91 @@
+#include <nusa.h>
+#include <nusaext.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define err(x) perror(x),exit(1)
+
+enum SZ {
+	MEMSZ = 100<<20,
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int check(const char *what, const unsigned char *p, size_t len,
+		 unsigned seed, int fill)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (p[i] != (fill ? seed : (unsigned char)(i * 7 + seed))) {
+			printf("%s: mismatch at %zu\n", what, i);
+			return 1;
+		}
+	return 0;
+}
+
+/* test bulk copy and fill against memcpy, at large and odd sizes */
+int main(void)
+{
+	static const size_t sizes[] = { 0, 1, 4095, (5 << 20) + 13, MEMSZ - 3 };
+	struct nusa_bulk_stats st;
+	unsigned char *src, *dst;
+	unsigned i;
+	size_t k;
+	double t;
+	int ret = 0;
+
+	if (nusa_available() < 0) {
+		printf("no NUMA API available\n");
+		exit(1);
+	}
+	src = nusa_alloc_interleaved(MEMSZ);
+	dst = nusa_alloc_interleaved(MEMSZ);
+	if (!src || !dst)
+		err("nusa_alloc_interleaved");
+
+	for (i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+		size_t len = sizes[i];
+		/* misalign one side */
+		unsigned char *s = src + 3, *d = dst + (len < MEMSZ - 3 ? 1 : 0);
+
+		for (k = 0; k < len; k++)
+			s[k] = k * 7 + i;
+		if (nusa_bulk_copy(d, s, len, &st) < 0)
+			err("nusa_bulk_copy");
+		ret |= check("copy", d, len, i, 0);
+		if (st.bytes != len)
+			printf("copy: stats bytes %zu, expected %zu\n", st.bytes, len),
+			ret = 1;
+		if (nusa_bulk_fill(d, 0x5a + i, len, &st) < 0)
+			err("nusa_bulk_fill");
+		ret |= check("fill", d, len, 0x5a + i, 1);
+	}
+
+	t = now();
+	memcpy(dst, src, MEMSZ);
+	t = now() - t;
+	nusa_bulk_copy(dst, src, MEMSZ, &st);
+	printf("memcpy %.0f MB/s, bulk copy %.0f MB/s on %d nodes in %lu chunks\n",
+	       MEMSZ / t / 1e6, st.bytes_per_sec / 1e6, st.nodes, st.chunks);
+	t = now();
+	memset(dst, 0, MEMSZ);
+	t = now() - t;
+	nusa_bulk_fill(dst, 0, MEMSZ, &st);
+	printf("memset %.0f MB/s, bulk fill %.0f MB/s\n",
+	       MEMSZ / t / 1e6, st.bytes_per_sec / 1e6);
+
+	nusa_free(src, MEMSZ);
+	nusa_free(dst, MEMSZ);
+	if (ret == 0)
+		printf("PASSED\n");
+	return ret;
+}
@@ -0,0 +1,243 @@
+/* Measure how long a cache line takes to move between two cpus.
+   Two threads pinned to a pair of cpus bounce one line with compare
+   and swap (default) or with plain stores and loads (-s). The one way
+   latency is printed as a matrix with the cpus grouped by node, then
+   summarized per relation: same cache, same node and per node distance,
+   to compare the coherence cost with nusa_distance().
+
+   c2clat [-s] [-n rounds] [-p pairs] */
+#define _GNU_SOURCE 1
+#include <nusa.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define err(x) perror(x),exit(1)
+
+static int use_store;
+static long rounds = 20000;
+
+static struct {
+	long val;
+	char pad[64 - sizeof(long)];
+} line __attribute__((aligned(64)));
+
+static pthread_barrier_t barrier;
+
+struct pingpong {
+	int cpu;
+	int first;	/* makes the odd moves */
+};
+
+static void pin(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof set, &set) < 0)
+		err("sched_setaffinity");
+}
+
+static void *bounce(void *arg)
+{
+	struct pingpong *pp = arg;
+	long i, want;
+
+	pin(pp->cpu);
+	pthread_barrier_wait(&barrier);
+	for (i = 0; i < rounds; i++) {
+		want = 2 * i + !pp->first;
+		if (use_store) {
+			while (__atomic_load_n(&line.val, __ATOMIC_ACQUIRE) != want)
+				;
+			__atomic_store_n(&line.val, want + 1, __ATOMIC_RELEASE);
+		} else {
+			long exp = want;
+
+			while (!__atomic_compare_exchange_n(&line.val, &exp,
+					want + 1, 0, __ATOMIC_ACQ_REL,
+					__ATOMIC_RELAXED))
+				exp = want;
+		}
+	}
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* One way latency between cpus a and b in ns */
+static double measure(int a, int b)
+{
+	struct pingpong pa = { a, 1 }, pb = { b, 0 };
+	pthread_t ta, tb;
+	double start;
+
+	line.val = 0;
+	pthread_barrier_init(&barrier, NULL, 3);
+	pthread_create(&ta, NULL, bounce, &pa);
+	pthread_create(&tb, NULL, bounce, &pb);
+	pthread_barrier_wait(&barrier);
+	start = now();
+	pthread_join(ta, NULL);
+	pthread_join(tb, NULL);
+	pthread_barrier_destroy(&barrier);
+	return (now() - start) / (2.0 * rounds);
+}
+
+/* Lowest cpu sharing the last level cache with cpu, -1 if unknown */
+static int cpu_llc(int cpu)
+{
+	char name[128];
+	int idx, first = -1;
+	FILE *f;
+
+	for (idx = 3; idx >= 2 && first < 0; idx--) {
+		snprintf(name, sizeof name,
+		 "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list",
+			 cpu, idx);
+		f = fopen(name, "r");
+		if (!f)
+			continue;
+		if (fscanf(f, "%d", &first) != 1)
+			first = -1;
+		fclose(f);
+	}
+	return first;
+}
+
+struct relation {
+	double sum;
+	long n;
+};
+
+int main(int ac, char **av)
+{
+	int ncpus, n = 0, i, j, c, maxnode, pairs = 0;
+	struct bitmask *allowed;
+	int *cpus, *node, *llc;
+	double *lat;
+	struct relation same_llc = { 0, 0 }, same_node = { 0, 0 };
+	struct relation *by_dist;
+	long todo, done = 0;
+
+	while ((c = getopt(ac, av, "sn:p:")) != -1) {
+		switch (c) {
+		case 's':
+			use_store = 1;
+			break;
+		case 'n':
+			rounds = atol(optarg);
+			break;
+		case 'p':
+			pairs = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: c2clat [-s] [-n rounds] [-p pairs]\n");
+			exit(1);
+		}
+	}
+	if (nusa_available() < 0) {
+		printf("no NUMA API available\n");
+		exit(1);
+	}
+	maxnode = nusa_max_node();
+	allowed = nusa_allocate_cpumask();
+	nusa_sched_getaffinity(0, allowed);
+	ncpus = allowed->size;
+	cpus = malloc(ncpus * sizeof(int));
+	node = malloc(ncpus * sizeof(int));
+	llc = malloc(ncpus * sizeof(int));
+	by_dist = calloc(256, sizeof(struct relation));
+	if (!cpus || !node || !llc || !by_dist)
+		err("malloc");
+
+	/* cpus grouped by node, then by cache */
+	for (j = 0; j <= maxnode; j++)
+		for (i = 0; i < ncpus; i++)
+			if (nusa_bitmask_isbitset(allowed, i) &&
+			    nusa_node_of_cpu(i) == j) {
+				cpus[n] = i;
+				node[n] = j;
+				llc[n++] = cpu_llc(i);
+			}
+	if (n < 2) {
+		printf("need at least two cpus\n");
+		return 0;
+	}
+	lat = calloc(n * n, sizeof(double));
+	if (!lat)
+		err("calloc");
+
+	/* with -p measure about that many pairs, spread over the matrix */
+	todo = (long)n * (n - 1) / 2;
+	for (i = 0; i < n; i++)
+		for (j = i + 1; j < n; j++) {
+			double l;
+			int d;
+
+			if (pairs && ((i * n + j) * 2654435761UL) % todo >=
+				     (unsigned long)pairs)
+				continue;
+			l = measure(cpus[i], cpus[j]);
+			lat[i * n + j] = lat[j * n + i] = l;
+			done++;
+			if (node[i] == node[j] && llc[i] >= 0 && llc[i] == llc[j]) {
+				same_llc.sum += l;
+				same_llc.n++;
+			} else if (node[i] == node[j]) {
+				same_node.sum += l;
+				same_node.n++;
+			} else {
+				d = nusa_distance(node[i], node[j]) & 255;
+				by_dist[d].sum += l;
+				by_dist[d].n++;
+			}
+		}
+
+	printf("%s one way latency in ns, %ld of %ld pairs\n",
+	       use_store ? "store/load" : "cas", done, todo);
+	printf("%8s", "");
+	for (j = 0; j < n; j++)
+		printf(" %5d", cpus[j]);
+	putchar('\n');
+	for (i = 0; i < n; i++) {
+		if (i == 0 || node[i] != node[i - 1])
+			printf("node %d\n", node[i]);
+		printf("%8d", cpus[i]);
+		for (j = 0; j < n; j++) {
+			if (i == j || lat[i * n + j] == 0)
+				printf(" %5s", "-");
+			else
+				printf(" %5.0f", lat[i * n + j]);
+		}
+		putchar('\n');
+	}
+
+	printf("\n%-24s %8s %8s\n", "relation", "pairs", "ns");
+	if (same_llc.n)
+		printf("%-24s %8ld %8.1f\n", "same cache", same_llc.n,
+		       same_llc.sum / same_llc.n);
+	if (same_node.n)
+		printf("%-24s %8ld %8.1f\n", "same node", same_node.n,
+		       same_node.sum / same_node.n);
+	for (i = 0; i < 256; i++)
+		if (by_dist[i].n) {
+			char name[32];
+
+			snprintf(name, sizeof name, "distance %d", i);
+			printf("%-24s %8ld %8.1f\n", name, by_dist[i].n,
+			       by_dist[i].sum / by_dist[i].n);
+		}
+	return 0;
+}
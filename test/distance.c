@@ -1,5 +1,6 @@
-/* Test nusa_distance */
+/* Test nusa_distance and the nearest node ordering */
 #include <nusa.h>
+#include <nusaext.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -37,5 +38,29 @@ int main(void)
 		}
 		printf("\n");
 	}
+
+	for (a = 0; a < got_nodes; a++) {
+		int na = node_to_use[a];
+		if (nusa_nearest_node(na, 0) != na ||
+		    nusa_node_hops(na, na) != 0) {
+			printf("%d: node is not its own nearest node\n", na);
+			exit(1);
+		}
+		for (b = 1; b < got_nodes; b++) {
+			int prev = nusa_nearest_node(na, b - 1);
+			int cur = nusa_nearest_node(na, b);
+			if (cur < 0 ||
+			    nusa_distance(na, cur) < nusa_distance(na, prev) ||
+			    nusa_node_hops(na, cur) < nusa_node_hops(na, prev)) {
+				printf("%d: nearest node %d (%d) out of order\n",
+				       na, b, cur);
+				exit(1);
+			}
+		}
+		if (nusa_nearest_node(na, got_nodes) != -1) {
+			printf("%d: too many nearest nodes\n", na);
+			exit(1);
+		}
+	}
 	return 0;
 }
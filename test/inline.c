@@ -0,0 +1,66 @@
+/* Check the inline fast paths against the library functions */
+#define _GNU_SOURCE 1
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "nusa.h"
+#include "nusaext.h"
+#include "nusainline.h"
+
+int main(void)
+{
+	struct bitmask *mask;
+	const int *map;
+	int i, ncpus;
+
+	if (nusa_available() < 0) {
+		printf("no nusa\n");
+		exit(1);
+	}
+
+	mask = nusa_bitmask_alloc(300);
+	srand(1);
+	for (i = 0; i < 10000; i++) {
+		unsigned n = rand() % 400;
+		int set = nusa_bitmask_isbitset(mask, n);
+
+		assert(nusa_bitmask_test(mask, n) == set);
+		if (rand() & 1)
+			nusa_bitmask_set(mask, n);
+		else
+			nusa_bitmask_clear(mask, n);
+		assert(nusa_bitmask_test(mask, n) == nusa_bitmask_isbitset(mask, n));
+	}
+
+	map = nusa_cpu_node_map(&ncpus);
+	if (!map) {
+		printf("cannot read cpu to node map\n");
+		exit(1);
+	}
+	assert(nusa_cpu_to_node == map && nusa_cpu_to_node_size == ncpus);
+	for (i = 0; i < ncpus; i++) {
+		int node = nusa_node_of_cpu(i);
+
+		assert(map[i] == (node < 0 ? -1 : node));
+		assert(nusa_node_of_cpu_fast(i) == node);
+	}
+	assert(nusa_node_of_cpu_fast(ncpus) < 0);
+	assert(nusa_node_of_cpu_fast(-1) < 0);
+
+	/* pin to each cpu in turn and compare the current node */
+	for (i = 0; i < ncpus; i++) {
+		cpu_set_t set;
+
+		if (map[i] < 0)
+			continue;
+		CPU_ZERO(&set);
+		CPU_SET(i, &set);
+		if (sched_setaffinity(0, sizeof set, &set) < 0)
+			continue;
+		assert(sched_getcpu() == i);
+		assert(nusa_current_node() == map[i]);
+	}
+	printf("Passed\n");
+	return 0;
+}
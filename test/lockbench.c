@@ -0,0 +1,149 @@
+/* Contention benchmark for the cohort lock and sharded counters.
+   Runs with the threads on the cpus of 1, 2 .. all nodes and compares
+   against a pthread mutex and a single shared atomic counter.
+   Also checks that the lock excludes and the counters add up.
+   lockbench [seconds per run] */
+#define _GNU_SOURCE 1
+#include <nusa.h>
+#include <nusaext.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define err(x) perror(x),exit(1)
+
+enum { MUTEX, COHORT, ATOMIC, SHARDED, NKINDS };
+static const char *kind_name[NKINDS] = {
+	"mutex", "cohort lock", "atomic counter", "sharded counter"
+};
+
+static int kind;
+static int stop;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct nusa_cohort_lock *cohort;
+static struct nusa_counter *counter;
+static long shared __attribute__((aligned(64)));
+static long protected[8];	/* touched in the critical section */
+
+struct worker {
+	pthread_t thread;
+	int cpu;
+	long ops;
+} __attribute__((aligned(64)));
+
+static void critical(void)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		protected[i]++;
+}
+
+static void *run(void *arg)
+{
+	struct worker *w = arg;
+	cpu_set_t set;
+	long ops = 0;
+
+	CPU_ZERO(&set);
+	CPU_SET(w->cpu, &set);
+	sched_setaffinity(0, sizeof set, &set);
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		switch (kind) {
+		case MUTEX:
+			pthread_mutex_lock(&mutex);
+			critical();
+			pthread_mutex_unlock(&mutex);
+			break;
+		case COHORT:
+			nusa_cohort_lock(cohort);
+			critical();
+			nusa_cohort_unlock(cohort);
+			break;
+		case ATOMIC:
+			__atomic_fetch_add(&shared, 1, __ATOMIC_RELAXED);
+			break;
+		case SHARDED:
+			nusa_counter_add(counter, 1);
+			break;
+		}
+		ops++;
+	}
+	w->ops = ops;
+	return NULL;
+}
+
+int main(int ac, char **av)
+{
+	double secs = ac > 1 ? atof(av[1]) : 0.2;
+	struct bitmask *cpus;
+	struct worker *w;
+	int *cpulist;
+	int ncpus = 0, nodes = 0, node, i, n, ret = 0;
+
+	if (nusa_available() < 0) {
+		printf("no NUMA API available\n");
+		exit(1);
+	}
+	cohort = nusa_cohort_lock_create();
+	counter = nusa_counter_create();
+	cpus = nusa_allocate_cpumask();
+	cpulist = malloc(cpus->size * sizeof(int));
+	w = calloc(cpus->size, sizeof(struct worker));
+	if (!cohort || !counter || !cpulist || !w)
+		err("setup");
+
+	printf("%-6s %-8s %-16s %12s\n", "nodes", "threads", "kind", "Mops/s");
+	for (node = 0; node <= nusa_max_node(); node++) {
+		if (nusa_node_to_cpus(node, cpus) < 0 ||
+		    nusa_bitmask_weight(cpus) == 0)
+			continue;
+		/* threads of the nodes so far, nodes added one at a time */
+		for (i = 0; i < cpus->size; i++)
+			if (nusa_bitmask_isbitset(cpus, i))
+				cpulist[ncpus++] = i;
+		nodes++;
+		for (kind = 0; kind < NKINDS; kind++) {
+			struct timespec ts = {
+				(time_t)secs, (long)((secs - (time_t)secs) * 1e9)
+			};
+			long total = 0, before_shared = shared;
+			long before_counter = nusa_counter_read(counter, -1);
+			long before_protected = protected[0];
+
+			stop = 0;
+			for (n = 0; n < ncpus; n++) {
+				w[n].cpu = cpulist[n];
+				pthread_create(&w[n].thread, NULL, run, &w[n]);
+			}
+			nanosleep(&ts, NULL);
+			__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+			for (n = 0; n < ncpus; n++) {
+				pthread_join(w[n].thread, NULL);
+				total += w[n].ops;
+			}
+			printf("%-6d %-8d %-16s %12.2f\n", nodes, ncpus,
+			       kind_name[kind], total / secs / 1e6);
+
+			if ((kind == MUTEX || kind == COHORT) &&
+			    protected[0] - before_protected != total) {
+				printf("lock lost updates: %ld of %ld\n",
+				       protected[0] - before_protected, total);
+				ret = 1;
+			}
+			if (kind == ATOMIC && shared - before_shared != total)
+				ret = 1;
+			if (kind == SHARDED &&
+			    nusa_counter_read(counter, -1) - before_counter !=
+			    total) {
+				printf("sharded counter off\n");
+				ret = 1;
+			}
+		}
+	}
+	nusa_cohort_lock_destroy(cohort);
+	nusa_counter_destroy(counter);
+	return ret;
+}
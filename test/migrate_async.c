@@ -0,0 +1,139 @@
+#include <nusa.h>
+#include <nusaif.h>
+#include <nusaext.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define err(x) perror(x),exit(1)
+
+enum SZ {
+	BIGSZ = 256<<20,
+	SMALLSZ = 1<<20,
+};
+
+static int order[2], norder;
+
+static void done_cb(struct nusa_migration *m, void *arg)
+{
+	(void)m;
+	order[__sync_fetch_and_add(&norder, 1)] = (long)arg;
+}
+
+/* test async migration: completion reporting, priority and cancel */
+int main(void)
+{
+	struct nusa_migration_stats st;
+	struct nusa_migration *big, *small, *m;
+	struct pollfd pfd;
+	char *bigmem, *smallmem;
+	int node, status, ret = 0;
+	pid_t pid;
+
+	if (nusa_available() < 0) {
+		printf("no NUMA API available\n");
+		exit(1);
+	}
+	node = nusa_max_node();
+	while (node > 0 && !nusa_bitmask_isbitset(nusa_all_nodes_ptr, node))
+		node--;
+	bigmem = nusa_alloc_onnode(BIGSZ, 0);
+	smallmem = nusa_alloc_onnode(SMALLSZ, 0);
+	if (!bigmem || !smallmem)
+		err("nusa_alloc_onnode");
+	memset(bigmem, 1, BIGSZ);
+	memset(smallmem, 1, SMALLSZ);
+
+	/* plain wait and eventfd */
+	m = nusa_migrate_range_async(smallmem, SMALLSZ, node, 0, 0, NULL, NULL);
+	if (!m)
+		err("nusa_migrate_range_async");
+	pfd.fd = nusa_migration_eventfd(m);
+	pfd.events = POLLIN;
+	if (pfd.fd < 0)
+		err("nusa_migration_eventfd");
+	if (poll(&pfd, 1, 10000) != 1 || !nusa_migration_poll(m)) {
+		printf("eventfd not signalled\n");
+		ret = 1;
+	}
+	if (nusa_migration_wait(m, &st) != 0 ||
+	    st.moved != SMALLSZ / getpagesize()) {
+		printf("small: moved %lu of %lu, failed %lu\n",
+		       st.moved, st.pages, st.failed);
+		ret = 1;
+	}
+	nusa_migration_free(m);
+
+	/* an urgent request overtakes a long one */
+	big = nusa_migrate_range_async(bigmem, BIGSZ, node, -1, 0, done_cb,
+				       (void *)1L);
+	small = nusa_migrate_range_async(smallmem, SMALLSZ, 0, 10, 0, done_cb,
+					 (void *)2L);
+	if (!big || !small)
+		err("nusa_migrate_range_async");
+	nusa_migration_wait(small, NULL);
+	nusa_migration_wait(big, &st);
+	if (norder != 2 || order[0] != 2) {
+		printf("priority: finished %d then %d\n", order[0], order[1]);
+		ret = 1;
+	}
+	if (st.moved + st.failed != st.pages || st.cancelled) {
+		printf("big: moved %lu failed %lu of %lu\n",
+		       st.moved, st.failed, st.pages);
+		ret = 1;
+	}
+	nusa_migration_free(small);
+	nusa_migration_free(big);
+
+	/* cancel stops early and is reported */
+	big = nusa_migrate_range_async(bigmem, BIGSZ, 0, 0, 0, NULL, NULL);
+	if (!big)
+		err("nusa_migrate_range_async");
+	if (nusa_migration_cancel(big) == 0) {
+		nusa_migration_wait(big, &st);
+		if (!st.cancelled || st.moved + st.failed >= st.pages) {
+			printf("cancel: moved %lu failed %lu of %lu\n",
+			       st.moved, st.failed, st.pages);
+			ret = 1;
+		}
+	}
+	nusa_migration_free(big);
+
+	/* a child does not hang on inherited handles and gets its own
+	   workers */
+	big = nusa_migrate_range_async(bigmem, BIGSZ, node, 0, 0, NULL, NULL);
+	if (!big)
+		err("nusa_migrate_range_async");
+	pid = fork();
+	if (pid < 0)
+		err("fork");
+	if (pid == 0) {
+		alarm(10);
+		nusa_migration_wait(big, NULL);
+		nusa_migration_free(big);
+		m = nusa_migrate_range_async(smallmem, SMALLSZ, 0, 0, 0, NULL,
+					     NULL);
+		if (!m)
+			err("nusa_migrate_range_async in child");
+		if (nusa_migration_wait(m, NULL) < 0)
+			err("nusa_migration_wait in child");
+		nusa_migration_free(m);
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0)
+		err("waitpid");
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		printf("fork: child failed, status %x\n", status);
+		ret = 1;
+	}
+	nusa_migration_free(big);
+
+	nusa_free(bigmem, BIGSZ);
+	nusa_free(smallmem, SMALLSZ);
+	if (ret == 0)
+		printf("PASSED\n");
+	return ret;
+}
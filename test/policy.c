@@ -0,0 +1,86 @@
+#include <nusa.h>
+#include <nusaif.h>
+#include <nusaext.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define err(x) perror(x),exit(1)
+
+enum SZ {
+	MEMSZ = 4<<20,
+};
+
+/* test the preferred many and local policies */
+int main(void)
+{
+	struct nusa_arena *arena;
+	struct bitmask *got;
+	int mode, ret = 0;
+	char *mem;
+
+	if (nusa_available() < 0) {
+		printf("no NUMA API available\n");
+		exit(1);
+	}
+
+	/* local needs no nodes */
+	arena = nusa_arena_create(MPOL_LOCAL, NULL, 0);
+	if (!arena)
+		err("nusa_arena_create local");
+	mem = nusa_arena_alloc(arena, 64);
+	if (!mem)
+		err("nusa_arena_alloc");
+	memset(mem, 1, 64);
+	nusa_arena_destroy(arena);
+
+	mem = mmap(NULL, MEMSZ, PROT_READ|PROT_WRITE,
+		   MAP_PRIVATE|MAP_ANONYMOUS, 0, 0);
+	if (mem == MAP_FAILED)
+		err("mmap");
+	got = nusa_allocate_nodemask();
+	if (mbind(mem, MEMSZ, MPOL_LOCAL, NULL, 0, 0) < 0)
+		err("mbind local");
+	if (get_prampolicy(&mode, got->maskp, got->size + 1, mem,
+			   MPOL_F_ADDR) < 0)
+		err("get_prampolicy");
+	if (mode != MPOL_LOCAL) {
+		printf("local: policy %d\n", mode);
+		ret = 1;
+	}
+
+	if (!nusa_has_preferred_many()) {
+		printf("no preferred many in this kernel\n");
+	} else {
+		nusa_set_preferred_many(nusa_all_nodes_ptr);
+		nusa_bitmask_free(got);
+		got = nusa_preferred_many();
+		if (!nusa_bitmask_equal(got, nusa_all_nodes_ptr)) {
+			printf("preferred many nodes differ\n");
+			ret = 1;
+		}
+		nusa_set_localalloc();
+
+		if (mbind(mem, MEMSZ, MPOL_PREFERRED_MANY,
+			  nusa_all_nodes_ptr->maskp,
+			  nusa_all_nodes_ptr->size + 1, 0) < 0)
+			err("mbind preferred many");
+		if (nusa_prefault_memory(mem, MEMSZ, 0,
+					 NUSA_PREFAULT_WRITE) < 0)
+			err("nusa_prefault_memory");
+		if (get_prampolicy(&mode, got->maskp, got->size + 1, mem,
+				   MPOL_F_ADDR) < 0)
+			err("get_prampolicy");
+		if (mode != MPOL_PREFERRED_MANY ||
+		    !nusa_bitmask_equal(got, nusa_all_nodes_ptr)) {
+			printf("preferred many: policy %d\n", mode);
+			ret = 1;
+		}
+	}
+	nusa_bitmask_free(got);
+	munmap(mem, MEMSZ);
+	if (ret == 0)
+		printf("PASSED\n");
+	return ret;
+}
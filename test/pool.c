@@ -0,0 +1,97 @@
+/* Test per node object pools: no object is handed out twice, objects
+   are on their node and the statistics add up. */
+#include <nusa.h>
+#include <nusaif.h>
+#include <nusaext.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define err(x) perror(x),exit(1)
+
+enum {
+	NTHREADS = 4,
+	NOBJS = 50000,
+	OBJSIZE = 200,
+};
+
+static struct nusa_pool *pool;
+static int failed;
+
+static void *worker(void *arg)
+{
+	long t = (long)arg;
+	unsigned char **objs = malloc(NOBJS * sizeof(void *));
+	int i, k;
+
+	if (!objs)
+		err("malloc");
+	for (k = 0; k < 4; k++) {
+		for (i = 0; i < NOBJS; i++) {
+			objs[i] = nusa_pool_alloc(pool);
+			if (!objs[i])
+				err("nusa_pool_alloc");
+			memset(objs[i], t, OBJSIZE);
+		}
+		/* another thread owning one of our objects would overwrite it */
+		for (i = 0; i < NOBJS; i++) {
+			if (objs[i][0] != t || objs[i][OBJSIZE - 1] != t) {
+				printf("object %p shared\n", objs[i]);
+				__atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+			}
+			nusa_pool_free(pool, objs[i]);
+		}
+	}
+	free(objs);
+	return NULL;
+}
+
+int main(void)
+{
+	pthread_t threads[NTHREADS];
+	struct nusa_pool_stats st;
+	int node, status;
+	long t;
+	void *p;
+
+	if (nusa_available() < 0) {
+		printf("no NUMA API available\n");
+		exit(1);
+	}
+	pool = nusa_pool_create(OBJSIZE);
+	if (!pool)
+		err("nusa_pool_create");
+
+	for (t = 0; t < NTHREADS; t++)
+		pthread_create(&threads[t], NULL, worker, (void *)t);
+	for (t = 0; t < NTHREADS; t++)
+		pthread_join(threads[t], NULL);
+
+	for (node = 0; node <= nusa_max_node(); node++) {
+		if (!nusa_bitmask_isbitset(nusa_all_nodes_ptr, node))
+			continue;
+		p = nusa_pool_alloc_onnode(pool, node);
+		if (!p)
+			err("nusa_pool_alloc_onnode");
+		*(char *)p = 1;
+		if (move_pages(0, 1, &p, NULL, &status, 0) < 0)
+			err("move_pages");
+		if (status != node) {
+			printf("object on node %d, expected %d\n", status, node);
+			failed = 1;
+		}
+		if (nusa_pool_stats(pool, node, &st) < 0)
+			err("nusa_pool_stats");
+		if (st.in_use != 1 || st.objects < st.in_use) {
+			printf("node %d: %lu in use, %lu objects\n", node,
+			       st.in_use, st.objects);
+			failed = 1;
+		}
+		nusa_pool_free(pool, p);
+	}
+	nusa_pool_destroy(pool);
+	if (!failed)
+		printf("Passed\n");
+	return failed;
+}
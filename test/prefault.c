@@ -0,0 +1,94 @@
+#include <nusa.h>
+#include <nusaif.h>
+#include <nusaext.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define err(x) perror(x),exit(1)
+
+enum SZ {
+	MEMSZ = 100<<20,
+};
+
+/* test if prefaulting faults in all pages on their interleave nodes. */
+int main(void)
+{
+	int i, k, w;
+	char *mem, *half;
+	struct bitmask *nodes;
+	int pagesz = getpagesize();
+	int npages = MEMSZ / pagesz;
+	void **pages;
+	int *status;
+	int *ilnodes;
+	int ret = 0;
+
+	if (nusa_available() < 0) {
+		printf("no NUMA API available\n");
+		exit(1);
+	}
+	mem = nusa_alloc_interleaved(MEMSZ);
+	if (!mem)
+		err("nusa_alloc_interleaved");
+	if (nusa_prefault_memory(mem, MEMSZ, 0, NUSA_PREFAULT_WRITE) < 0)
+		err("nusa_prefault_memory");
+
+	pages = malloc(npages * sizeof(void *));
+	status = malloc(npages * sizeof(int));
+	ilnodes = malloc((nusa_max_node() + 1) * sizeof(int));
+	nodes = nusa_allocate_nodemask();
+	if (!pages || !status || !ilnodes)
+		err("malloc");
+	for (i = 0; i < npages; i++)
+		pages[i] = mem + i * pagesz;
+	/* does not fault in, so missing pages show up as -ENOENT */
+	if (move_pages(0, npages, pages, NULL, status, 0) < 0)
+		err("move_pages");
+
+	for (i = 0, w = 0; i <= nusa_max_node(); i++)
+		if (nusa_bitmask_isbitset(nusa_all_nodes_ptr, i))
+			ilnodes[w++] = i;
+	for (k = 0; k < w && ilnodes[k] != status[0]; k++)
+		;
+	for (i = 0; i < npages; i++, k = (k + 1) % w) {
+		if (status[i] < 0) {
+			printf("page %d not present (%d)\n", i, status[i]);
+			ret = 1;
+		} else if (status[i] != ilnodes[k]) {
+			printf("page %d node %d expected %d\n", i, status[i],
+			       ilnodes[k]);
+			ret = 1;
+		}
+	}
+
+	/* bind the second half: the two halves are planned separately */
+	nusa_bitmask_clearall(nodes);
+	nusa_bitmask_setbit(nodes, ilnodes[w - 1]);
+	half = mem + MEMSZ / 2;
+	if (mbind(half, MEMSZ / 2, MPOL_BIND, nodes->maskp, nodes->size + 1,
+		  MPOL_MF_MOVE) < 0)
+		err("mbind");
+	if (madvise(mem, MEMSZ, MADV_DONTNEED) < 0)
+		err("madvise");
+	if (nusa_prefault_memory(mem, MEMSZ, 0, NUSA_PREFAULT_WRITE) < 0)
+		err("nusa_prefault_memory");
+	if (move_pages(0, npages, pages, NULL, status, 0) < 0)
+		err("move_pages");
+	for (i = 0; i < npages; i++) {
+		if (status[i] < 0) {
+			printf("page %d not present after mbind (%d)\n", i,
+			       status[i]);
+			ret = 1;
+		} else if ((char *)pages[i] >= half &&
+			   status[i] != ilnodes[w - 1]) {
+			printf("page %d node %d expected bound %d\n", i,
+			       status[i], ilnodes[w - 1]);
+			ret = 1;
+		}
+	}
+	nusa_free(mem, MEMSZ);
+	nusa_bitmask_free(nodes);
+	return ret;
+}
@@ -0,0 +1,80 @@
+/* Test node replicated regions: readers always see one complete
+   version while a writer publishes new ones. */
+#include <nusa.h>
+#include <nusaext.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define err(x) perror(x),exit(1)
+
+enum {
+	NREADERS = 2,
+	SIZE = 16 << 10,
+	NVERSIONS = 500,
+};
+
+static struct nusa_replica *rep;
+static int done, failed;
+
+static void *reader(void *arg)
+{
+	unsigned long last = 0;
+
+	while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+		const unsigned long *p = nusa_replica_read_lock(rep);
+		unsigned long v = p[0];
+		int i;
+
+		for (i = 1; i < SIZE / sizeof(long); i++)
+			if (p[i] != v) {
+				printf("torn read: %lu and %lu\n", v, p[i]);
+				failed = 1;
+				break;
+			}
+		if (v < last) {
+			printf("version went back from %lu to %lu\n", last, v);
+			failed = 1;
+		}
+		last = v;
+		nusa_replica_read_unlock(rep, p);
+	}
+	return NULL;
+}
+
+int main(void)
+{
+	pthread_t threads[NREADERS];
+	unsigned long v;
+	int i;
+
+	if (nusa_available() < 0) {
+		printf("no NUMA API available\n");
+		exit(1);
+	}
+	rep = nusa_replica_create(SIZE, NULL);
+	if (!rep)
+		err("nusa_replica_create");
+	for (i = 0; i < NREADERS; i++)
+		pthread_create(&threads[i], NULL, reader, NULL);
+	for (v = 1; v <= NVERSIONS; v++) {
+		unsigned long *p = nusa_replica_write_begin(rep);
+
+		for (i = 0; i < SIZE / sizeof(long); i++)
+			p[i] = v;
+		nusa_replica_publish(rep);
+	}
+	__atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < NREADERS; i++)
+		pthread_join(threads[i], NULL);
+
+	if (*(unsigned long *)nusa_replica_read_lock(rep) != NVERSIONS) {
+		printf("last version not visible\n");
+		failed = 1;
+	}
+	nusa_replica_destroy(rep);
+	if (!failed)
+		printf("Passed\n");
+	return failed;
+}
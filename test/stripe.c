@@ -0,0 +1,71 @@
+#include <nusa.h>
+#include <nusaif.h>
+#include <nusaext.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define err(x) perror(x),exit(1)
+
+enum SZ {
+	MEMSZ = 64<<20,
+	CHUNK = 2<<20,
+};
+
+/* test that striped memory lands chunk by chunk on the nodes in turn */
+int main(void)
+{
+	int pagesz = getpagesize();
+	int npages = MEMSZ / pagesz;
+	int i, k, w, ret = 0;
+	void **pages;
+	int *status, *node;
+	char *mem;
+
+	if (nusa_available() < 0) {
+		printf("no NUMA API available\n");
+		exit(1);
+	}
+	if (nusa_stripe_memory(NULL, MEMSZ, nusa_all_nodes_ptr, pagesz + 1,
+			       0) == 0 || errno != EINVAL) {
+		printf("unaligned chunk accepted\n");
+		ret = 1;
+	}
+	mem = nusa_alloc_striped(MEMSZ, nusa_all_nodes_ptr, CHUNK,
+				 NUSA_STRIPE_STRICT);
+	if (!mem)
+		err("nusa_alloc_striped");
+	if ((unsigned long)mem & (CHUNK - 1)) {
+		printf("%p not aligned to the chunk\n", mem);
+		ret = 1;
+	}
+	memset(mem, 1, MEMSZ);
+
+	pages = malloc(npages * sizeof(void *));
+	status = malloc(npages * sizeof(int));
+	node = malloc((nusa_max_node() + 1) * sizeof(int));
+	if (!pages || !status || !node)
+		err("malloc");
+	for (i = 0, w = 0; i <= nusa_max_node(); i++)
+		if (nusa_bitmask_isbitset(nusa_all_nodes_ptr, i))
+			node[w++] = i;
+	for (i = 0; i < npages; i++)
+		pages[i] = mem + i * pagesz;
+	if (move_pages(0, npages, pages, NULL, status, 0) < 0)
+		err("move_pages");
+	for (i = 0; i < npages; i++) {
+		k = (long)i * pagesz / CHUNK % w;
+		if (status[i] != node[k]) {
+			printf("page %d on node %d, expected %d\n", i,
+			       status[i], node[k]);
+			ret = 1;
+			break;
+		}
+	}
+	nusa_free(mem, MEMSZ);
+	if (ret == 0)
+		printf("PASSED\n");
+	return ret;
+}
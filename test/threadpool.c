@@ -0,0 +1,108 @@
+/* Test the thread pool: every task runs once, tasks may submit tasks
+   and the parallel for covers the whole range exactly once. */
+#include <nusa.h>
+#include <nusaext.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define err(x) perror(x),exit(1)
+
+enum {
+	NTASKS = 10000,
+	MEMSZ = 64 << 20,
+	SMALLSZ = 64 << 10,
+	ROUNDS = 2000,
+};
+
+static struct nusa_threadpool *tp;
+static unsigned long ran[NTASKS];
+
+static void leaf(void *arg)
+{
+	__atomic_add_fetch(&ran[(long)arg], 1, __ATOMIC_RELAXED);
+}
+
+/* split into two children until one task is left */
+static void split(void *arg)
+{
+	long v = (long)arg;
+	long lo = v >> 32, hi = v & 0xffffffff;
+
+	if (hi - lo == 1) {
+		leaf((void *)lo);
+		return;
+	}
+	nusa_threadpool_submit(tp, -1, split,
+			       (void *)(lo << 32 | (lo + hi) / 2));
+	nusa_threadpool_submit(tp, -1, split,
+			       (void *)((lo + hi) / 2 << 32 | hi));
+}
+
+static void fill(void *start, size_t len, void *arg)
+{
+	unsigned char *p = start;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		p[i]++;
+}
+
+int main(void)
+{
+	unsigned char *mem;
+	int i, ret = 0;
+
+	if (nusa_available() < 0) {
+		printf("no NUMA API available\n");
+		exit(1);
+	}
+	tp = nusa_threadpool_create(NULL, 0);
+	if (!tp)
+		err("nusa_threadpool_create");
+
+	for (i = 0; i < NTASKS; i++)
+		if (nusa_threadpool_submit(tp, i % (nusa_max_node() + 1),
+					   leaf, (void *)(long)i) < 0)
+			err("nusa_threadpool_submit");
+	nusa_threadpool_wait(tp);
+	nusa_threadpool_submit(tp, -1, split, (void *)(long)NTASKS);
+	nusa_threadpool_wait(tp);
+	for (i = 0; i < NTASKS; i++)
+		if (ran[i] != 2) {
+			printf("task %d ran %lu times\n", i, ran[i]);
+			ret = 1;
+		}
+
+	mem = nusa_alloc_interleaved(MEMSZ);
+	if (!mem)
+		err("nusa_alloc_interleaved");
+	memset(mem, 0, MEMSZ);
+	if (nusa_threadpool_for_pages(tp, mem, MEMSZ - 100, 0, fill, NULL) < 0)
+		err("nusa_threadpool_for_pages");
+	for (i = 0; i < MEMSZ; i++)
+		if (mem[i] != (i < MEMSZ - 100)) {
+			printf("byte %d is %d\n", i, mem[i]);
+			ret = 1;
+			break;
+		}
+
+	/* many short runs of page sized chunks: the waiter returns while
+	   the last workers may still be finishing */
+	memset(mem, 0, SMALLSZ);
+	for (i = 0; i < ROUNDS; i++)
+		if (nusa_threadpool_for_pages(tp, mem, SMALLSZ, 1, fill,
+					      NULL) < 0)
+			err("nusa_threadpool_for_pages");
+	for (i = 0; i < SMALLSZ; i++)
+		if (mem[i] != (unsigned char)ROUNDS) {
+			printf("small: byte %d is %d\n", i, mem[i]);
+			ret = 1;
+			break;
+		}
+	nusa_free(mem, MEMSZ);
+	nusa_threadpool_destroy(tp);
+	if (!ret)
+		printf("Passed\n");
+	return ret;
+}
@@ -0,0 +1,49 @@
+#include <nusa.h>
+#include <nusaext.h>
+#include <nusainline.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* test that the lazy cpu to node and distance tables agree with
+   libnusa */
+int main(void)
+{
+	const int *map;
+	int i, node, ncpus, ret = 0;
+
+	if (nusa_available() < 0) {
+		printf("no NUMA API available\n");
+		exit(1);
+	}
+	map = nusa_cpu_node_map(&ncpus);
+	if (!map || ncpus < nusa_num_configured_cpus()) {
+		printf("cpu map not built: %d cpus\n", ncpus);
+		ret = 1;
+	}
+	for (i = 0; map && i < ncpus; i++) {
+		node = nusa_node_of_cpu(i);
+		if (node >= 0 && map[i] != node) {
+			printf("cpu %d: node %d, expected %d\n", i, map[i],
+			       node);
+			ret = 1;
+		}
+	}
+	if (nusa_bitmask_isbitset(nusa_nodes_ptr, 0) &&
+	    nusa_distance(0, 0) != 10) {
+		printf("distance of node 0 to itself %d\n",
+		       nusa_distance(0, 0));
+		ret = 1;
+	}
+	for (node = 0; node <= nusa_max_node(); node++) {
+		if (!nusa_bitmask_isbitset(nusa_nodes_ptr, node))
+			continue;
+		if (nusa_nearest_node(node, 0) != node) {
+			printf("node %d: nearest node %d\n", node,
+			       nusa_nearest_node(node, 0));
+			ret = 1;
+		}
+	}
+	if (ret == 0)
+		printf("PASSED\n");
+	return ret;
+}
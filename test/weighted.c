@@ -0,0 +1,87 @@
+#include <nusa.h>
+#include <nusaif.h>
+#include <nusaext.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define err(x) perror(x),exit(1)
+
+enum SZ {
+	MEMSZ = 16<<20,
+};
+
+static int check_weights(const double *bw, const int *expect, int n)
+{
+	int w[8], i;
+
+	nusa_interleave_weights_from_bandwidth(bw, w, n);
+	for (i = 0; i < n; i++)
+		if (w[i] != expect[i]) {
+			printf("weight %d is %d, expected %d\n", i, w[i],
+			       expect[i]);
+			return 1;
+		}
+	return 0;
+}
+
+/* test weight derivation and the weighted interleave policy */
+int main(void)
+{
+	static const double bw1[] = { 100000, 50000 };
+	static const int w1[] = { 2, 1 };
+	static const double bw2[] = { 30000, 10000, 0 };
+	static const int w2[] = { 3, 1, 0 };
+	static const double bw3[] = { 250000, 1000 };
+	static const int w3[] = { 255, 1 };
+	int i, w, mode, ret = 0;
+	struct bitmask *got;
+	char *mem;
+
+	ret |= check_weights(bw1, w1, 2);
+	ret |= check_weights(bw2, w2, 3);
+	ret |= check_weights(bw3, w3, 2);
+
+	if (nusa_available() < 0) {
+		printf("no NUMA API available\n");
+		exit(1);
+	}
+	for (i = 0; i <= nusa_max_node(); i++) {
+		if (!nusa_bitmask_isbitset(nusa_all_nodes_ptr, i))
+			continue;
+		w = nusa_interleave_weight(i);
+		if (w < 0 && errno != ENOENT)
+			printf("node %d: cannot read weight: %s\n", i,
+			       strerror(errno)), ret = 1;
+	}
+
+	mem = mmap(NULL, MEMSZ, PROT_READ|PROT_WRITE,
+		   MAP_PRIVATE|MAP_ANONYMOUS, 0, 0);
+	if (mem == MAP_FAILED)
+		err("mmap");
+	if (nusa_weighted_interleave_memory(mem, MEMSZ,
+					    nusa_all_nodes_ptr) < 0) {
+		if (errno != EINVAL)
+			err("nusa_weighted_interleave_memory");
+		printf("no weighted interleave in this kernel\n");
+	} else {
+		got = nusa_allocate_nodemask();
+		memset(mem, 1, MEMSZ);
+		if (get_prampolicy(&mode, got->maskp, got->size + 1, mem,
+				   MPOL_F_ADDR) < 0)
+			err("get_prampolicy");
+		if (mode != MPOL_WEIGHTED_INTERLEAVE ||
+		    !nusa_bitmask_equal(got, nusa_all_nodes_ptr)) {
+			printf("policy %d, expected %d\n", mode,
+			       MPOL_WEIGHTED_INTERLEAVE);
+			ret = 1;
+		}
+		nusa_bitmask_free(got);
+	}
+	munmap(mem, MEMSZ);
+	if (ret == 0)
+		printf("PASSED\n");
+	return ret;
+}
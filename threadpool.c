@@ -0,0 +1,495 @@
+/* Topology aware work stealing thread pool.
+
+   libnusa is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; version
+   2.1.
+
+   libnusa is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should find a copy of v2.1 of the GNU Lesser General Public License
+   somewhere on your Linux system; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+   Each worker is pinned to one cpu and owns a deque. It runs its own
+   tasks newest first and steals the oldest tasks of others when it runs
+   dry. The steal order is fixed at creation: workers sharing the last
+   level cache, then the rest of the node, then the other nodes from
+   nearest to farthest by distance. So work only crosses a node when the
+   whole node is idle. */
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "nusa.h"
+#include "nusaif.h"
+#include "nusaint.h"
+#include "nusaext.h"
+#include "topology.h"
+
+#define DEQUE_MIN	64	/* initial deque slots */
+#define FOR_CHUNK	(2UL << 20)	/* default parallel for chunk */
+
+struct tp_task {
+	void (*fn)(void *arg);
+	void *arg;
+};
+
+struct tp_worker {
+	pthread_spinlock_t lock;
+	struct tp_task *tasks;		/* ring of mask + 1 slots */
+	unsigned long head, tail;	/* steal at head, own end at tail */
+	unsigned long mask;
+	struct nusa_threadpool *pool;
+	pthread_t thread;
+	int cpu, node;
+	int *steal;			/* other workers in steal order */
+	int nsteal;
+} __attribute__((aligned(64)));
+
+struct nusa_threadpool {
+	struct tp_worker *workers;
+	int nworkers;
+	int nnodes;
+	int *node_first, *node_count;	/* workers of each node */
+	unsigned *node_next;		/* round robin per node */
+	unsigned long queued;		/* tasks waiting in deques */
+	unsigned long pending;		/* tasks submitted, not finished */
+	int sleepers;
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t work;		/* queued became non zero */
+	pthread_cond_t idle;		/* pending became zero */
+};
+
+static __thread struct tp_worker *self;
+
+static int deque_push(struct tp_worker *w, struct tp_task *t)
+{
+	pthread_spin_lock(&w->lock);
+	if (w->tail - w->head > w->mask) {
+		unsigned long n = (w->mask + 1) * 2, i;
+		struct tp_task *nt = malloc(n * sizeof(struct tp_task));
+
+		if (!nt) {
+			pthread_spin_unlock(&w->lock);
+			return -1;
+		}
+		for (i = w->head; i != w->tail; i++)
+			nt[i & (n - 1)] = w->tasks[i & w->mask];
+		free(w->tasks);
+		w->tasks = nt;
+		w->mask = n - 1;
+	}
+	w->tasks[w->tail & w->mask] = *t;
+	/* tail and head are peeked at without the lock in deque_take */
+	__atomic_store_n(&w->tail, w->tail + 1, __ATOMIC_RELAXED);
+	pthread_spin_unlock(&w->lock);
+	return 0;
+}
+
+/* Take from the owner's end (own) or the thief's end */
+static int deque_take(struct tp_worker *w, struct tp_task *t, int own)
+{
+	int ret = 0;
+
+	if (__atomic_load_n(&w->tail, __ATOMIC_RELAXED) ==
+	    __atomic_load_n(&w->head, __ATOMIC_RELAXED))
+		return 0;
+	pthread_spin_lock(&w->lock);
+	if (w->tail != w->head) {
+		if (own) {
+			*t = w->tasks[(w->tail - 1) & w->mask];
+			__atomic_store_n(&w->tail, w->tail - 1, __ATOMIC_RELAXED);
+		} else {
+			*t = w->tasks[w->head & w->mask];
+			__atomic_store_n(&w->head, w->head + 1, __ATOMIC_RELAXED);
+		}
+		ret = 1;
+	}
+	pthread_spin_unlock(&w->lock);
+	return ret;
+}
+
+static int find_task(struct tp_worker *w, struct tp_task *t)
+{
+	int i;
+
+	if (deque_take(w, t, 1))
+		return 1;
+	for (i = 0; i < w->nsteal; i++)
+		if (deque_take(&w->pool->workers[w->steal[i]], t, 0))
+			return 1;
+	return 0;
+}
+
+static void task_done(struct nusa_threadpool *tp)
+{
+	if (__atomic_sub_fetch(&tp->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		pthread_mutex_lock(&tp->lock);
+		pthread_cond_broadcast(&tp->idle);
+		pthread_mutex_unlock(&tp->lock);
+	}
+}
+
+static void *worker_main(void *arg)
+{
+	struct tp_worker *w = arg;
+	struct nusa_threadpool *tp = w->pool;
+	struct bitmask *cpus = nusa_allocate_cpumask();
+	struct tp_task t;
+
+	self = w;
+	nusa_bitmask_setbit(cpus, w->cpu);
+	nusa_sched_setaffinity(0, cpus);
+	nusa_bitmask_free(cpus);
+
+	for (;;) {
+		if (find_task(w, &t)) {
+			__atomic_sub_fetch(&tp->queued, 1, __ATOMIC_RELAXED);
+			t.fn(t.arg);
+			task_done(tp);
+			continue;
+		}
+		pthread_mutex_lock(&tp->lock);
+		__atomic_add_fetch(&tp->sleepers, 1, __ATOMIC_SEQ_CST);
+		while (!tp->stop &&
+		       __atomic_load_n(&tp->queued, __ATOMIC_SEQ_CST) == 0)
+			pthread_cond_wait(&tp->work, &tp->lock);
+		__atomic_sub_fetch(&tp->sleepers, 1, __ATOMIC_SEQ_CST);
+		if (tp->stop && !__atomic_load_n(&tp->queued, __ATOMIC_SEQ_CST)) {
+			pthread_mutex_unlock(&tp->lock);
+			break;
+		}
+		pthread_mutex_unlock(&tp->lock);
+	}
+	return NULL;
+}
+
+/* Order the other workers for stealing: same cache, same node, then
+   by node distance. */
+static int build_steal_order(struct nusa_threadpool *tp, struct tp_worker *w,
+			     const int *llc)
+{
+	int i, k, node, n = 0;
+
+	w->steal = malloc(tp->nworkers * sizeof(int));
+	if (!w->steal)
+		return -1;
+	for (i = 0; i < tp->nworkers; i++) {
+		struct tp_worker *o = &tp->workers[i];
+
+		if (o != w && llc && llc[w->cpu] >= 0 &&
+		    llc[o->cpu] == llc[w->cpu] && o->node == w->node)
+			w->steal[n++] = i;
+	}
+	for (i = 0; i < tp->nworkers; i++) {
+		struct tp_worker *o = &tp->workers[i];
+
+		if (o != w && o->node == w->node &&
+		    !(llc && llc[w->cpu] >= 0 && llc[o->cpu] == llc[w->cpu]))
+			w->steal[n++] = i;
+	}
+	for (k = 1; (node = nusa_nearest_node(w->node, k)) >= 0; k++)
+		for (i = 0; i < tp->node_count[node]; i++)
+			w->steal[n++] = tp->node_first[node] + i;
+	/* nodes the distance table does not know */
+	for (node = 0; node < tp->nnodes; node++)
+		if (node != w->node && nusa_node_hops(w->node, node) < 0)
+			for (i = 0; i < tp->node_count[node]; i++)
+				w->steal[n++] = tp->node_first[node] + i;
+	w->nsteal = n;
+	return 0;
+}
+
+/* Create a pool with workers on the cpus of nodes (NULL for all nodes).
+   per_node limits the workers per node, 0 for one per cpu. */
+struct nusa_threadpool *nusa_threadpool_create(struct bitmask *nodes,
+					       int per_node)
+{
+	struct nusa_threadpool *tp;
+	const int *cpu_node = topo_cpu_node_table();
+	const int *llc = topo_cpu_llc_table();
+	int ncpus = topo_num_cpus();
+	struct bitmask *allowed;
+	int i, cpu, node, n;
+
+	if (!cpu_node || per_node < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	tp = calloc(1, sizeof(struct nusa_threadpool));
+	if (!tp)
+		return NULL;
+	tp->nnodes = nusa_max_node() + 1;
+	tp->node_first = calloc(tp->nnodes, sizeof(int));
+	tp->node_count = calloc(tp->nnodes, sizeof(int));
+	tp->node_next = calloc(tp->nnodes, sizeof(unsigned));
+	if (posix_memalign((void **)&tp->workers, 64,
+			   ncpus * sizeof(struct tp_worker)))
+		tp->workers = NULL;
+	if (!tp->node_first || !tp->node_count || !tp->node_next ||
+	    !tp->workers)
+		goto fail;
+
+	/* workers sorted by node, on the cpus we may run on */
+	allowed = nusa_allocate_cpumask();
+	nusa_sched_getaffinity(0, allowed);
+	for (node = 0; node < tp->nnodes; node++) {
+		tp->node_first[node] = tp->nworkers;
+		if (nodes ? !nusa_bitmask_isbitset(nodes, node) :
+			    !nusa_bitmask_isbitset(nusa_nodes_ptr, node))
+			continue;
+		for (cpu = 0, n = 0; cpu < ncpus; cpu++) {
+			struct tp_worker *w = &tp->workers[tp->nworkers];
+
+			if (cpu_node[cpu] != node ||
+			    !nusa_bitmask_isbitset(allowed, cpu))
+				continue;
+			if (per_node && n >= per_node)
+				break;
+			memset(w, 0, sizeof(struct tp_worker));
+			w->pool = tp;
+			w->cpu = cpu;
+			w->node = node;
+			w->mask = DEQUE_MIN - 1;
+			w->tasks = malloc(DEQUE_MIN * sizeof(struct tp_task));
+			if (!w->tasks) {
+				nusa_bitmask_free(allowed);
+				errno = ENOMEM;
+				goto fail;
+			}
+			pthread_spin_init(&w->lock, PTHREAD_PROCESS_PRIVATE);
+			tp->nworkers++;
+			n++;
+		}
+		tp->node_count[node] = n;
+	}
+	nusa_bitmask_free(allowed);
+	if (tp->nworkers == 0) {
+		errno = EINVAL;
+		goto fail;
+	}
+	for (i = 0; i < tp->nworkers; i++)
+		if (build_steal_order(tp, &tp->workers[i], llc) < 0)
+			goto fail;
+	pthread_mutex_init(&tp->lock, NULL);
+	pthread_cond_init(&tp->work, NULL);
+	pthread_cond_init(&tp->idle, NULL);
+	for (i = 0; i < tp->nworkers; i++)
+		if (pthread_create(&tp->workers[i].thread, NULL, worker_main,
+				   &tp->workers[i]))
+			break;
+	if (i < tp->nworkers) {
+		for (n = i; n < tp->nworkers; n++) {
+			free(tp->workers[n].tasks);
+			free(tp->workers[n].steal);
+			pthread_spin_destroy(&tp->workers[n].lock);
+		}
+		tp->nworkers = i;
+		nusa_threadpool_destroy(tp);
+		errno = EAGAIN;
+		return NULL;
+	}
+	return tp;
+fail:
+	/* the pool's lock and condvars are not initialised yet */
+	if (tp->workers)
+		for (i = 0; i < tp->nworkers; i++) {
+			free(tp->workers[i].tasks);
+			free(tp->workers[i].steal);
+			pthread_spin_destroy(&tp->workers[i].lock);
+		}
+	free(tp->workers);
+	free(tp->node_first);
+	free(tp->node_count);
+	free(tp->node_next);
+	free(tp);
+	return NULL;
+}
+
+/* Queue fn(arg) on node, or -1 for the caller's own queue when called
+   from a task and the current node otherwise. */
+int nusa_threadpool_submit(struct nusa_threadpool *tp, int node,
+			   void (*fn)(void *arg), void *arg)
+{
+	struct tp_task t = { fn, arg };
+	struct tp_worker *w;
+
+	if (node < 0 && self && self->pool == tp) {
+		w = self;
+	} else {
+		if (node < 0)
+			node = nusa_current_node();
+		if (node < 0 || node >= tp->nnodes || !tp->node_count[node]) {
+			/* no workers there: the nearest node that has some */
+			int k, near = -1;
+
+			for (k = 1; node >= 0 && node < tp->nnodes; k++) {
+				near = nusa_nearest_node(node, k);
+				if (near < 0 || tp->node_count[near])
+					break;
+			}
+			node = near >= 0 ? near : tp->workers[0].node;
+		}
+		w = &tp->workers[tp->node_first[node] +
+			__atomic_fetch_add(&tp->node_next[node], 1,
+					   __ATOMIC_RELAXED) %
+			tp->node_count[node]];
+	}
+
+	__atomic_add_fetch(&tp->pending, 1, __ATOMIC_RELAXED);
+	if (deque_push(w, &t) < 0) {
+		task_done(tp);
+		errno = ENOMEM;
+		return -1;
+	}
+	__atomic_add_fetch(&tp->queued, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&tp->sleepers, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&tp->lock);
+		pthread_cond_broadcast(&tp->work);
+		pthread_mutex_unlock(&tp->lock);
+	}
+	return 0;
+}
+
+/* Wait until all submitted tasks have finished. Not from a task. */
+void nusa_threadpool_wait(struct nusa_threadpool *tp)
+{
+	pthread_mutex_lock(&tp->lock);
+	while (__atomic_load_n(&tp->pending, __ATOMIC_ACQUIRE))
+		pthread_cond_wait(&tp->idle, &tp->lock);
+	pthread_mutex_unlock(&tp->lock);
+}
+
+/* Finish all queued tasks, then stop the workers and free the pool */
+void nusa_threadpool_destroy(struct nusa_threadpool *tp)
+{
+	int i;
+
+	if (!tp)
+		return;
+	pthread_mutex_lock(&tp->lock);
+	tp->stop = 1;
+	pthread_cond_broadcast(&tp->work);
+	pthread_mutex_unlock(&tp->lock);
+	for (i = 0; i < tp->nworkers; i++) {
+		pthread_join(tp->workers[i].thread, NULL);
+		free(tp->workers[i].tasks);
+		free(tp->workers[i].steal);
+		pthread_spin_destroy(&tp->workers[i].lock);
+	}
+	pthread_mutex_destroy(&tp->lock);
+	pthread_cond_destroy(&tp->work);
+	pthread_cond_destroy(&tp->idle);
+	free(tp->workers);
+	free(tp->node_first);
+	free(tp->node_count);
+	free(tp->node_next);
+	free(tp);
+}
+
+struct for_chunk {
+	void (*fn)(void *start, size_t len, void *arg);
+	void *arg;
+	char *start;
+	size_t len;
+	struct for_state *state;
+};
+
+struct for_state {
+	unsigned long left;
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+};
+
+static void for_task(void *arg)
+{
+	struct for_chunk *c = arg;
+	struct for_state *st = c->state;
+
+	c->fn(c->start, c->len, c->arg);
+	/* st is on the waiter's stack: once left is 0 and the lock is
+	   dropped it may be gone, so count and signal under the lock */
+	pthread_mutex_lock(&st->lock);
+	if (--st->left == 0)
+		pthread_cond_signal(&st->done);
+	pthread_mutex_unlock(&st->lock);
+}
+
+/* Call fn on chunks of [start, start + len) in the pool and wait for
+   all of them. Each chunk runs on the node its first page is on, so the
+   work follows the data. Chunks that are not faulted in yet go to the
+   current node. chunk is the chunk size, 0 for 2MB. Not from a task.
+   Returns 0, 1 when the nodes of the pages could not be read and every
+   chunk went to the current node, or -1 on error. */
+int nusa_threadpool_for_pages(struct nusa_threadpool *tp, void *start,
+			      size_t len, size_t chunk,
+			      void (*fn)(void *start, size_t len, void *arg),
+			      void *arg)
+{
+	size_t page = getpagesize();
+	unsigned long i, n;
+	struct for_chunk *chunks;
+	struct for_state st;
+	void **pages;
+	int *status;
+	int ret = 0;
+
+	if (!chunk)
+		chunk = FOR_CHUNK;
+	chunk = (chunk + page - 1) & ~(page - 1);
+	n = (len + chunk - 1) / chunk;
+	if (n == 0)
+		return 0;
+	chunks = malloc(n * sizeof(struct for_chunk));
+	pages = malloc(n * sizeof(void *));
+	status = malloc(n * sizeof(int));
+	if (!chunks || !pages || !status) {
+		ret = -1;
+		goto out;
+	}
+	for (i = 0; i < n; i++)
+		pages[i] = (void *)((unsigned long)((char *)start + i * chunk) &
+				    ~(page - 1));
+	/* with no target nodes move_pages only reports where pages are */
+	if (move_pages(0, n, pages, NULL, status, 0) < 0) {
+		for (i = 0; i < n; i++)
+			status[i] = -1;
+		ret = 1;
+	}
+
+	st.left = n;
+	pthread_mutex_init(&st.lock, NULL);
+	pthread_cond_init(&st.done, NULL);
+	for (i = 0; i < n; i++) {
+		struct for_chunk *c = &chunks[i];
+
+		c->fn = fn;
+		c->arg = arg;
+		c->start = (char *)start + i * chunk;
+		c->len = i == n - 1 ? len - i * chunk : chunk;
+		c->state = &st;
+		if (nusa_threadpool_submit(tp, status[i] >= 0 ? status[i] : -1,
+					   for_task, c) < 0) {
+			/* run it here instead */
+			for_task(c);
+		}
+	}
+	pthread_mutex_lock(&st.lock);
+	while (st.left)
+		pthread_cond_wait(&st.done, &st.lock);
+	pthread_mutex_unlock(&st.lock);
+	pthread_mutex_destroy(&st.lock);
+	pthread_cond_destroy(&st.done);
+out:
+	free(chunks);
+	free(pages);
+	free(status);
+	return ret;
+}
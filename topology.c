@@ -0,0 +1,172 @@
+/* On demand topology tables.
+
+   libnusa is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; version
+   2.1.
+
+   libnusa is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should find a copy of v2.1 of the GNU Lesser General Public License
+   somewhere on your Linux system; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+   The tables here are not set up at load time. Each one is built the
+   first time it is asked for, so programs that never use it don't pay
+   for it. pthread_once makes the result visible to all threads once
+   built. The node set and the number of cpus are the ones nusa_init
+   already read, and the cpu to node table is filled from the node cpu
+   masks libnusa keeps, so nothing here scans sysfs a second time. */
+#define _GNU_SOURCE 1
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "nusa.h"
+#include "nusaext.h"
+#include "nusainline.h"
+#include "nusaint.h"
+#include "snapshot.h"
+#include "sysfs.h"
+#include "bitmask.h"
+#include "topology.h"
+
+/* Number of possible cpus */
+hidden int topo_num_cpus(void)
+{
+	return nusa_num_possible_cpus();
+}
+
+/* Highest configured node plus one */
+hidden int topo_num_nodes(void)
+{
+	return nusa_max_node() + 1;
+}
+
+/* Nodes with memory or cpus */
+hidden const struct bitmask *topo_nodes(void)
+{
+	return nusa_nodes_ptr;
+}
+
+static int cpu_node_ncpus;
+static int *cpu_node;
+static pthread_once_t cpu_node_once = PTHREAD_ONCE_INIT;
+
+/* Exported copy of the table for the inline lookups in nusainline.h.
+   The pointer is published last, so a reader that sees it non NULL
+   also sees the size. */
+const int *nusa_cpu_to_node;
+int nusa_cpu_to_node_size;
+
+static void build_cpu_node(void)
+{
+	const struct topo_snapshot *snap = topo_snapshot();
+	const struct bitmask *online = topo_nodes();
+	int ncpus = topo_num_cpus();
+	int nnodes = topo_num_nodes();
+	struct bitmask *cpus;
+	int *table;
+	int i, node;
+
+	if (ncpus <= 0)
+		return;
+	table = malloc(ncpus * sizeof(int));
+	if (!table)
+		return;
+	for (i = 0; i < ncpus; i++)
+		table[i] = -1;
+
+	if (snap && snap->ncpus == ncpus) {
+		const int32_t *map = SNAPSHOT_ARRAY(snap, int32_t, cpu_node_off);
+		for (i = 0; i < ncpus; i++)
+			table[i] = map[i];
+		goto out;
+	}
+
+	/* The cpu masks of the nodes are cached by libnusa */
+	cpus = nusa_allocate_cpumask();
+	for (node = 0; node < nnodes; node++) {
+		if (!nusa_bitmask_isbitset(online, node) ||
+		    nusa_node_to_cpus(node, cpus) < 0)
+			continue;
+		for (i = 0; i < ncpus && i < (int)cpus->size; i++)
+			if (nusa_bitmask_isbitset(cpus, i))
+				table[i] = node;
+	}
+	nusa_bitmask_free(cpus);
+out:
+	cpu_node_ncpus = ncpus;
+	cpu_node = table;
+	nusa_cpu_to_node_size = ncpus;
+	__atomic_store_n(&nusa_cpu_to_node, table, __ATOMIC_RELEASE);
+}
+
+/* Return the cpu to node table, indexed by cpu number, -1 for cpus
+   without a node. NULL when it cannot be built. */
+hidden const int *topo_cpu_node_table(void)
+{
+	pthread_once(&cpu_node_once, build_cpu_node);
+	return cpu_node;
+}
+
+/* Build the cpu to node table if needed and return it, with the number
+   of entries in *ncpus. */
+const int *nusa_cpu_node_map(int *ncpus)
+{
+	const int *t = topo_cpu_node_table();
+
+	if (ncpus)
+		*ncpus = t ? cpu_node_ncpus : 0;
+	return t;
+}
+
+static int *cpu_llc;
+static pthread_once_t cpu_llc_once = PTHREAD_ONCE_INIT;
+
+/* Name each last level cache by the lowest cpu sharing it */
+static void build_cpu_llc(void)
+{
+	int ncpus = topo_num_cpus();
+	struct bitmask *shared;
+	char name[64], buf[SYSFS_BLOCK];
+	int *table;
+	int cpu, idx;
+
+	if (ncpus <= 0)
+		return;
+	table = malloc(ncpus * sizeof(int));
+	shared = nusa_bitmask_alloc(ncpus);
+	if (!table || !shared) {
+		free(table);
+		if (shared)
+			nusa_bitmask_free(shared);
+		return;
+	}
+	for (cpu = 0; cpu < ncpus; cpu++) {
+		table[cpu] = -1;
+		/* index3 is the L3 on most systems, some only have L2 */
+		for (idx = 3; idx >= 2 && table[cpu] < 0; idx--) {
+			snprintf(name, sizeof name,
+				 "cpu%d/cache/index%d/shared_cpu_list", cpu, idx);
+			if (sysfs_read_dir(SYSFS_CPU_DIR, name, buf,
+					   sizeof buf) < 0)
+				continue;
+			nusa_bitmask_clearall(shared);
+			if (bitmask_parse_list(buf, shared) == 0)
+				table[cpu] = nusa_bitmask_next(shared, 0);
+		}
+	}
+	nusa_bitmask_free(shared);
+	cpu_llc = table;
+}
+
+/* Return the last level cache of each cpu, named by the lowest cpu
+   sharing it, -1 when unknown. NULL when it cannot be built. */
+hidden const int *topo_cpu_llc_table(void)
+{
+	pthread_once(&cpu_llc_once, build_cpu_llc);
+	return cpu_llc;
+}
@@ -0,0 +1,18 @@
+/* Lazily built topology tables. Each table is filled on first use,
+   under its own pthread_once, from what nusa_init already read. */
+hidden int topo_num_cpus(void);
+hidden int topo_num_nodes(void);
+hidden const struct bitmask *topo_nodes(void);
+hidden const int *topo_cpu_node_table(void);
+hidden const int *topo_cpu_llc_table(void);
+
+/* Cpu the caller runs on, read from rseq when possible (syscall.c) */
+hidden int current_cpu(void);
+
+static inline int topo_cpu_node(int cpu)
+{
+	const int *t = topo_cpu_node_table();
+	if (!t || (unsigned)cpu >= topo_num_cpus())
+		return -1;
+	return t[cpu];
+}
@@ -14,6 +14,7 @@
    on your Linux system; if not, write to the Free Software Foundation,
    Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA */
 #include "nusa.h"
+#include "nusaext.h"
 #include "nusaif.h"
 #include "util.h"
 #include <stdio.h>
@@ -28,19 +29,15 @@ void printmask(char *name, struct bitmask *mask)
 {
 	int i;
 	printf("%s: ", name);
-	for (i = 0; i < mask->size; i++)
-		if (nusa_bitmask_isbitset(mask, i))
-			printf("%d ", i);
+	for (i = nusa_bitmask_next(mask, 0); i >= 0;
+	     i = nusa_bitmask_next(mask, i + 1))
+		printf("%d ", i);
 	putchar('\n');
 }
 
 int find_first(struct bitmask *mask)
 {
-	int i;
-	for (i = 0; i < mask->size; i++)
-		if (nusa_bitmask_isbitset(mask, i))
-			return i;
-	return -1;
+	return nusa_bitmask_next(mask, 0);
 }
 
 void complain(char *fmt, ...)
@@ -89,22 +86,48 @@ static struct policy {
 	{ "interleave", MPOL_INTERLEAVE, },
 	{ "membind",    MPOL_BIND, },
 	{ "preferred",   MPOL_PREFERRED, },
+	{ "preferred-many", MPOL_PREFERRED_MANY, },
+	{ "local",      MPOL_LOCAL, 1 },
+	{ "weighted-interleave", MPOL_WEIGHTED_INTERLEAVE, },
 	{ "default",    MPOL_DEFAULT, 1 },
 	{ NULL },
 };
 
-static char *policy_names[] = { "default", "preferred", "bind", "interleave" };
+static char *policy_names[] = {
+	[MPOL_DEFAULT] = "default",
+	[MPOL_PREFERRED] = "preferred",
+	[MPOL_BIND] = "bind",
+	[MPOL_INTERLEAVE] = "interleave",
+	[MPOL_LOCAL] = "local",
+	[MPOL_PREFERRED_MANY] = "preferred-many",
+	[MPOL_WEIGHTED_INTERLEAVE] = "weighted-interleave",
+};
 
 char *policy_name(int policy)
 {
 	static char buf[32];
-	if (policy >= array_len(policy_names)) {
+	if (policy < 0 || policy >= array_len(policy_names) ||
+	    !policy_names[policy]) {
 		sprintf(buf, "[%d]", policy);
 		return buf;
 	}
 	return policy_names[policy];
 }
 
+/* Map a policy name as accepted by parse_policy or printed by
+   policy_name back to the policy. Returns -1 for unknown names. */
+int policy_from_name(char *name)
+{
+	int k;
+	for (k = 0; policies[k].name; k++)
+		if (!strcmp(policies[k].name, name))
+			return policies[k].policy;
+	for (k = 0; k < array_len(policy_names); k++)
+		if (policy_names[k] && !strcmp(policy_names[k], name))
+			return k;
+	return -1;
+}
+
 int parse_policy(char *name, char *arg)
 {
 	int k;
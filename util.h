@@ -13,6 +13,7 @@ extern long memsize(char *s);
 extern int parse_policy(char *name, char *arg);
 extern void print_policies(void);
 extern char *policy_name(int policy);
+extern int policy_from_name(char *name);
 
 #define err(x) perror("nusactl: " x),exit(1)
 #define array_len(x) (sizeof(x)/sizeof(*(x)))
@@ -0,0 +1,143 @@
+/* Weighted interleave.
+
+   libnusa is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; version
+   2.1.
+
+   libnusa is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should find a copy of v2.1 of the GNU Lesser General Public License
+   somewhere on your Linux system; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+   MPOL_WEIGHTED_INTERLEAVE (Linux 6.9) gives each node weight pages in
+   a row before moving on to the next. The weights are system wide, in
+   /sys/kernel/mm/mempolicy/weighted_interleave/nodeN. Setting them in
+   proportion to the bandwidth of each node lets a mix of fast and slow
+   memory, say DRAM and CXL, run near their combined bandwidth instead of
+   at the pace of the slowest. */
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "nusa.h"
+#include "nusaif.h"
+#include "nusaint.h"
+#include "nusaext.h"
+#include "sysfs.h"
+
+#define WEIGHT_DIR	"/sys/kernel/mm/mempolicy/weighted_interleave"
+#define WEIGHT_MAX	255	/* kernel limit */
+#define WEIGHT_STEPS	8	/* resolution of the slowest node's share */
+
+/* Return the interleave weight of node, or -1 with errno set (ENOENT
+   when the kernel has no weighted interleave). */
+int nusa_interleave_weight(int node)
+{
+	char fn[64], buf[16];
+	int w;
+
+	snprintf(fn, sizeof fn, WEIGHT_DIR "/node%d", node);
+	if (sysfs_read_at(AT_FDCWD, fn, buf, sizeof buf) <= 0)
+		return -1;
+	w = atoi(buf);
+	if (w < 1 || w > WEIGHT_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	return w;
+}
+
+/* Set the system wide interleave weight of node, 1 to 255. Needs root. */
+int nusa_set_interleave_weight(int node, int weight)
+{
+	char fn[64], buf[16];
+	int fd, n, ret = 0;
+
+	if (weight < 1 || weight > WEIGHT_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	snprintf(fn, sizeof fn, WEIGHT_DIR "/node%d", node);
+	fd = open(fn, O_WRONLY|O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	n = snprintf(buf, sizeof buf, "%d\n", weight);
+	if (write(fd, buf, n) != n)
+		ret = -1;
+	close(fd);
+	return ret;
+}
+
+static int gcd(int a, int b)
+{
+	while (b) {
+		int t = a % b;
+
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* Turn the bandwidth of n nodes into interleave weights in proportion,
+   reduced to the smallest integers that keep the ratios to about an
+   eighth of the slowest node's share. Nodes with bandwidth <= 0 get
+   weight 0, to be left out. Returns the number of nodes weighted. */
+int nusa_interleave_weights_from_bandwidth(const double *bw, int *weights,
+					   int n)
+{
+	double min = 0, max = 0, scale;
+	int i, g = 0, count = 0;
+
+	for (i = 0; i < n; i++) {
+		if (bw[i] <= 0)
+			continue;
+		if (min == 0 || bw[i] < min)
+			min = bw[i];
+		if (bw[i] > max)
+			max = bw[i];
+	}
+	if (min == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	scale = WEIGHT_STEPS / min;
+	if (max * scale > WEIGHT_MAX)
+		scale = WEIGHT_MAX / max;
+	for (i = 0; i < n; i++) {
+		weights[i] = 0;
+		if (bw[i] <= 0)
+			continue;
+		weights[i] = bw[i] * scale + 0.5;
+		if (weights[i] < 1)
+			weights[i] = 1;
+		g = gcd(weights[i], g);
+		count++;
+	}
+	for (i = 0; i < n; i++)
+		weights[i] /= g;
+	return count;
+}
+
+/* Weighted interleave [mem, mem + size) over nodes. Fails with EINVAL
+   on kernels without MPOL_WEIGHTED_INTERLEAVE. */
+int nusa_weighted_interleave_memory(void *mem, size_t size,
+				    struct bitmask *nodes)
+{
+	return mbind(mem, size, MPOL_WEIGHTED_INTERLEAVE, nodes->maskp,
+		     nodes->size + 1, 0);
+}
+
+/* Make weighted interleave over nodes the policy of the calling thread */
+int nusa_set_weighted_interleave_mask(struct bitmask *nodes)
+{
+	return set_prampolicy(MPOL_WEIGHTED_INTERLEAVE, nodes->maskp,
+			      nodes->size + 1);
+}